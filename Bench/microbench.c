@@ -0,0 +1,394 @@
+//Component microbenchmarks for the threadpool, request parser,
+//mimetype lookup, target canonicalization and response header rendering.
+//
+//Results are written as one JSON object per line to the file given as the
+//first argument (default "microbench.json"), a summary goes to stderr.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../Source/threadpool.h"
+#include "../Source/request.h"
+#include "../Source/mime.h"
+#include "../Source/response.h"
+#include "../Source/route.h"
+#include "../Source/trace.h"
+#include "../Source/uri.h"
+
+#define WARMUP        3
+#define REPETITIONS   15
+#define TASKS         20000
+#define LATENCY_TASKS 2000
+
+//hardware counters read around a measurement
+typedef struct counters_t {
+    int fd[2];
+    uint64_t value[2];
+} counters_t;
+
+//aggregated results of one benchmark
+typedef struct result_t {
+    const char *name;
+    int threads;
+    long ops;
+    double ns[REPETITIONS];
+    double cycles[REPETITIONS];
+    double instructions;
+    double misses;
+} result_t;
+
+static FILE *out;
+static counters_t *inherited = NULL;
+static double cycles_per_ns = 0;
+static volatile uint64_t sink = 0;
+
+//returns the cycle counter, else nanoseconds where unavailable
+static inline uint64_t cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return trace_now();
+#endif
+}
+
+//estimates cycle counter frequency against the monotonic clock
+static void calibrate(void) {
+    uint64_t ns = trace_now(), c = cycles();
+    usleep(100000);
+    cycles_per_ns = (double)(cycles() - c) / (double)(trace_now() - ns);
+}
+
+//opens a perf event counting the calling thread, and with inherit the
+//threads it creates afterwards, returns -1 if perf events are unavailable
+static int perf_open(uint64_t config, int group, int inherit) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group < 0;
+    attr.inherit = inherit;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+//opens instruction and cache miss counters, stopped until counters_start
+static void counters_open(counters_t *ctr, int inherit) {
+    ctr->fd[0] = perf_open(PERF_COUNT_HW_INSTRUCTIONS, -1, inherit);
+    ctr->fd[1] = ctr->fd[0] < 0 ? -1 : perf_open(PERF_COUNT_HW_CACHE_MISSES, ctr->fd[0], inherit);
+}
+
+static void counters_start(counters_t *ctr) {
+    if (ctr->fd[0] >= 0) {
+        ioctl(ctr->fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(ctr->fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+static void counters_stop(counters_t *ctr) {
+    if (ctr->fd[0] >= 0)
+        ioctl(ctr->fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    for (int i = 0; i < 2; i++) {
+        ctr->value[i] = (uint64_t)-1;
+        if (ctr->fd[i] >= 0 && read(ctr->fd[i], &ctr->value[i], sizeof(uint64_t)) != sizeof(uint64_t))
+            ctr->value[i] = (uint64_t)-1;
+    }
+}
+
+static void counters_close(counters_t *ctr) {
+    for (int i = 0; i < 2; i++)
+        if (ctr->fd[i] >= 0)
+            close(ctr->fd[i]);
+}
+
+static int compare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+//writes result as a JSON line and a summary line
+static void report(result_t *res) {
+    qsort(res->ns, REPETITIONS, sizeof(double), compare);
+    qsort(res->cycles, REPETITIONS, sizeof(double), compare);
+
+    double mean = 0;
+    for (int i = 0; i < REPETITIONS; i++)
+        mean += res->ns[i] / REPETITIONS;
+
+    fprintf(out, "{\"name\":\"%s\",\"threads\":%i,\"ops\":%li,\"repetitions\":%i,"
+        "\"ns_min\":%.2f,\"ns_median\":%.2f,\"ns_mean\":%.2f,\"ns_max\":%.2f,"
+        "\"cycles_median\":%.1f,\"instructions\":%.1f,\"cache_misses\":%.3f}\n",
+        res->name, res->threads, res->ops, REPETITIONS,
+        res->ns[0], res->ns[REPETITIONS / 2], mean, res->ns[REPETITIONS - 1],
+        res->cycles[REPETITIONS / 2], res->instructions, res->misses);
+
+    fprintf(stderr, "%-24s threads=%-2i median %10.2f ns/op %10.1f cycles/op",
+        res->name, res->threads, res->ns[REPETITIONS / 2], res->cycles[REPETITIONS / 2]);
+    if (res->instructions >= 0)
+        fprintf(stderr, " %8.1f instr/op %6.3f misses/op", res->instructions, res->misses);
+    fprintf(stderr, "\n");
+}
+
+//runs body ops times per repetition after warming up, recording per
+//operation costs, counted on the calling thread unless inherited is set
+static void measure(result_t *res, void (*body)(void *, long), void *ctx) {
+    counters_t own, *ctr = inherited;
+    if (ctr == NULL)
+        counters_open(ctr = &own, 0);
+
+    for (int i = 0; i < WARMUP; i++)
+        body(ctx, res->ops);
+
+    res->instructions = res->misses = 0;
+    for (int i = 0; i < REPETITIONS; i++) {
+        counters_start(ctr);
+        uint64_t ns = trace_now(), c = cycles();
+        body(ctx, res->ops);
+        uint64_t c_end = cycles(), ns_end = trace_now();
+        counters_stop(ctr);
+
+        res->ns[i] = (double)(ns_end - ns) / res->ops;
+        res->cycles[i] = (double)(c_end - c) / res->ops;
+        if (ctr->value[0] == (uint64_t)-1 || res->instructions < 0)
+            res->instructions = res->misses = -1;
+        else {
+            res->instructions += (double)ctr->value[0] / res->ops / REPETITIONS;
+            res->misses += (double)ctr->value[1] / res->ops / REPETITIONS;
+        }
+    }
+
+    if (ctr == &own)
+        counters_close(&own);
+    report(res);
+}
+
+
+
+//----------------------------------------------------------------------------//
+// Threadpool                                                                 //
+//----------------------------------------------------------------------------//
+
+typedef struct handoff_t {
+    threadpool_t *pool;
+    atomic_long done;
+    atomic_ullong waited;
+} handoff_t;
+
+static void handoff_task(void *arg) {
+    handoff_t *ctx = (handoff_t *)arg;
+    atomic_fetch_add(&ctx->done, 1);
+}
+
+//schedules ops tasks and waits for all of them to have run
+static void handoff_throughput(void *arg, long ops) {
+    handoff_t *ctx = (handoff_t *)arg;
+    atomic_store(&ctx->done, 0);
+
+    for (long i = 0; i < ops; i++)
+        while (threadpool_schedule(ctx->pool, handoff_task, ctx, LANE_INTERACTIVE) < 0)
+            sched_yield();
+
+    while (atomic_load(&ctx->done) < ops)
+        sched_yield();
+}
+
+static void latency_task(void *arg) {
+    handoff_t *ctx = (handoff_t *)arg;
+    uint64_t queued, dequeued;
+    threadpool_task_times(&queued, &dequeued);
+    atomic_fetch_add(&ctx->waited, dequeued - queued);
+    atomic_fetch_add(&ctx->done, 1);
+}
+
+//schedules one task at a time, measuring schedule to dequeue latency
+static void handoff_latency(void *arg, long ops) {
+    handoff_t *ctx = (handoff_t *)arg;
+    atomic_store(&ctx->done, 0);
+
+    for (long i = 0; i < ops; i++) {
+        //a dropped task would never be counted done
+        if (threadpool_schedule(ctx->pool, latency_task, ctx, LANE_INTERACTIVE) < 0) {
+            fprintf(stderr, "Failed to schedule task\n");
+            exit(1);
+        }
+        while (atomic_load(&ctx->done) <= i)
+            ;
+    }
+}
+
+static void bench_threadpool(void) {
+    int counts[] = {1, 2, 4, 8};
+
+    for (int i = 0; i < (int)(sizeof(counts) / sizeof(counts[0])); i++) {
+        //count the workers along with the caller, only threads
+        //created after the counters are opened inherit them
+        counters_t ctr;
+        counters_open(&ctr, 1);
+        inherited = &ctr;
+
+        handoff_t ctx;
+        ctx.pool = threadpool_create(counts[i], TASKS);
+        if (ctx.pool == NULL) {
+            fprintf(stderr, "Failed to create threadpool\n");
+            exit(1);
+        }
+
+        result_t res = {"threadpool_throughput", counts[i], TASKS};
+        measure(&res, handoff_throughput, &ctx);
+
+        //report latency from the task's own enqueue and dequeue stamps
+        atomic_store(&ctx.waited, 0);
+        result_t lat = {"threadpool_latency", counts[i], LATENCY_TASKS};
+        measure(&lat, handoff_latency, &ctx);
+        fprintf(out, "{\"name\":\"threadpool_queue_wait\",\"threads\":%i,\"ns_mean\":%.2f}\n",
+            counts[i], (double)atomic_load(&ctx.waited) / ((WARMUP + REPETITIONS) * LATENCY_TASKS));
+
+        threadpool_destroy(ctx.pool);
+        inherited = NULL;
+        counters_close(&ctr);
+    }
+}
+
+
+
+//----------------------------------------------------------------------------//
+// Request handling                                                           //
+//----------------------------------------------------------------------------//
+
+static const char *requests[] = {
+    "GET /index.html HTTP/1.1\r\nHost: localhost\r\nUser-Agent: bench\r\n\r\n",
+    "GET /pic_mountain.jpg HTTP/1.1\r\nHost: localhost\r\nAccept: */*\r\n\r\n",
+    "POST /form HTTP/1.1\r\nHost: localhost\r\nContent-Length: 0\r\n\r\n",
+    "GET / HTTP/1.0\r\n\r\n"};
+
+static void parse(void *arg, long ops) {
+    char req[1024];
+    int num = sizeof(requests) / sizeof(requests[0]);
+
+    for (long i = 0; i < ops; i++) {
+        char *target;
+        strcpy(req, requests[i % num]);
+        sink += parse_request(req, &target) + (target != NULL);
+    }
+}
+
+static const char *paths[] = {
+    "/index.html", "/hello.js", "/favicon.ico", "/pic_mountain.jpg",
+    "/docs/manual.pdf", "/archive.tar.gz", "/noextension", "/a.b/c.txt",
+    "/health", "/api/v3/resource10", "/api/v5/resource999/items", "/api/v1/missing"};
+
+static void lookup(void *arg, long ops) {
+    int num = sizeof(paths) / sizeof(paths[0]);
+
+    for (long i = 0; i < ops; i++)
+        sink += mime_lookup(paths[i % num]) != NULL;
+}
+
+static const char *targets[] = {
+    "/index.html", "/", "/pic_mountain.jpg?size=large", "/docs/",
+    "/a//b/./c.txt", "/%69ndex%2Ehtml", "/static/js/vendor/framework.min.js",
+    "/search?q=needle#results"};
+
+static void canonicalize(void *arg, long ops) {
+    char buf[1024];
+    int num = sizeof(targets) / sizeof(targets[0]);
+
+    for (long i = 0; i < ops; i++)
+        sink += uri_canonicalize(targets[i % num], buf, sizeof(buf));
+}
+
+static void render(void *arg, long ops) {
+    char buf[1024];
+    int num = 0;
+
+    //the table ends at an empty entry, its size is not visible here
+    while (files[num].extension != 0)
+        num++;
+
+    for (long i = 0; i < ops; i++)
+        sink += render_header(buf, sizeof(buf), files[i % num].type, 75672 + i);
+}
+
+static int route_handler(int method, const char *target, builder_t *res) {
+    return 0;
+}
+
+static void route(void *arg, long ops) {
+    int num = sizeof(paths) / sizeof(paths[0]);
+
+    for (long i = 0; i < ops; i++)
+        sink += route_lookup(REQ_GET, paths[i % num]) != NULL;
+}
+
+//measures lookups against route tables of growing size
+static void bench_routes(void) {
+    char prefix[64];
+    int counts[] = {4, 64, 1024};
+    int registered = 0;
+
+    for (int i = 0; i < (int)(sizeof(counts) / sizeof(counts[0])); i++) {
+        for (; registered < counts[i]; registered++) {
+            snprintf(prefix, sizeof(prefix), "/api/v%i/resource%i", registered % 7, registered);
+            route_register(REQ_GET, prefix, route_handler);
+        }
+        route_register(REQ_GET, "/health", route_handler);
+        route_compile();
+
+        char name[32];
+        snprintf(name, sizeof(name), "route_lookup_%i", counts[i] + 1);
+        result_t res = {name, 1, 1000000};
+        measure(&res, route, NULL);
+    }
+
+    route_destroy();
+}
+
+static void bench_request(void) {
+    result_t res = {"parse_request", 1, 1000000};
+    measure(&res, parse, NULL);
+
+    result_t mime = {"mime_lookup", 1, 1000000};
+    measure(&mime, lookup, NULL);
+
+    result_t uri = {"uri_canonicalize", 1, 1000000};
+    measure(&uri, canonicalize, NULL);
+
+    result_t header = {"render_header", 1, 1000000};
+    measure(&header, render, NULL);
+}
+
+
+
+int main(int argc, char **argv) {
+    const char *file = argc > 1 ? argv[1] : "microbench.json";
+
+    out = fopen(file, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Failed to open \"%s\"\n", file);
+        return 1;
+    }
+
+    calibrate();
+    fprintf(out, "{\"name\":\"calibration\",\"cycles_per_ns\":%.4f}\n", cycles_per_ns);
+
+    bench_request();
+    bench_routes();
+    bench_threadpool();
+
+    fclose(out);
+    fprintf(stderr, "Results written to \"%s\"\n", file);
+
+    return 0;
+}
@@ -0,0 +1,412 @@
+//Replays a traffic capture recorded with CAPTURE_FILE against a running
+//server and reports latency percentiles and errors per request target.
+//
+//usage: replay [-s speed] [-c concurrency] [-a address] [-p port]
+//              [-o results] capture
+//
+//Requests are sent in capture order at their original spacing divided by
+//speed, or back to back with a speed of 0. Each request uses one of
+//concurrency connections at a time, so a replay that falls behind sends
+//late rather than dropping requests. Latency is measured from when a request
+//was due rather than when it went out, so time spent queued behind slow
+//responses counts against the server, and how late requests went out is
+//reported on its own. Results are written as one JSON object per line to
+//the results file if given, a summary goes to stdout.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../Source/main.h"
+#include "../Source/capture.h"
+#include "../Source/trace.h"
+
+#define CONCURRENCY   8
+#define TIMEOUT       10        //seconds to wait on a response
+#define KEY_SIZE      256       //bytes of method and target used to group results
+
+#define STATUS_FAILED -1        //connect, send or receive failed
+#define STATUS_BAD    -2        //response is not HTTP
+
+//captured request and the outcome of replaying it
+typedef struct entry_t {
+    uint64_t time;
+    uint32_t len;
+    char *req;
+    char key[KEY_SIZE];
+    uint64_t latency;
+    uint64_t late;
+    int status;
+} entry_t;
+
+//latency distribution and outcomes of one target
+typedef struct summary_t {
+    const char *key;
+    long count;
+    long failed;
+    long client_errors;
+    long server_errors;
+    double p50, p90, p99, max;
+    double late_p50, late_p99, late_max;
+} summary_t;
+
+static entry_t *entries = NULL;
+static long entries_num = 0;
+static atomic_long next = 0;
+static uint64_t start = 0;
+static double speed = 1.0;
+static struct sockaddr_in target;
+
+//extracts the method and target of a request head as its result key
+static void entry_key(entry_t *entry) {
+    const char *line = entry->req;
+    size_t len = 0;
+    int spaces = 0;
+
+    while (len < entry->len && len < KEY_SIZE - 1 && line[len] != '\r' && line[len] != '\n') {
+        if (line[len] == ' ' && ++spaces == 2)
+            break;
+        len++;
+    }
+
+    //keep keys printable and safe to embed in JSON strings
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)line[i];
+        entry->key[i] = c < 0x20 || c == 0x7f || c == '"' || c == '\\' ? '?' : c;
+    }
+    entry->key[len] = 0;
+}
+
+static int compare_time(const void *a, const void *b) {
+    const entry_t *x = (const entry_t *)a, *y = (const entry_t *)b;
+    return (x->time > y->time) - (x->time < y->time);
+}
+
+//reads all records of a capture file sorted by arrival,
+//returns 0 if successful, else returns a negative value
+static int load(const char *path) {
+    char magic[8];
+    capture_record_t record;
+    long size = 0;
+
+    FILE *in = fopen(path, "rb");
+    if (in == NULL)
+        return -1;
+
+    if (fread(magic, 1, 8, in) != 8 || memcmp(magic, CAPTURE_MAGIC, 8) != 0) {
+        fclose(in);
+        return -2;
+    }
+
+    while (fread(&record, sizeof(record), 1, in) == 1) {
+        if (entries_num == size) {
+            size = size ? size * 2 : 1024;
+            entry_t *grown = (entry_t *)realloc(entries, size * sizeof(entry_t));
+            if (grown == NULL) {
+                fclose(in);
+                return -3;
+            }
+            entries = grown;
+        }
+
+        entry_t *entry = &entries[entries_num];
+        memset(entry, 0, sizeof(entry_t));
+        entry->time = le64toh(record.time);
+        entry->len = le32toh(record.len);
+        if (entry->len > CAPTURE_MAX || (entry->req = (char *)malloc(entry->len + 1)) == NULL) {
+            fclose(in);
+            return -3;
+        }
+
+        //a truncated last record is dropped
+        if (fread(entry->req, 1, entry->len, in) != entry->len) {
+            free(entry->req);
+            break;
+        }
+        entry->req[entry->len] = 0;
+        entry_key(entry);
+        entries_num++;
+    }
+
+    fclose(in);
+
+    //requests are captured roughly in arrival order, replay them exactly in it
+    qsort(entries, entries_num, sizeof(entry_t), compare_time);
+    return 0;
+}
+
+//sends one request and reads the response until the server closes,
+//returns the HTTP status, else returns STATUS_FAILED or STATUS_BAD
+static int send_request(const entry_t *entry) {
+    char buf[4096];
+    char head[16];
+    size_t head_len = 0;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return STATUS_FAILED;
+
+    struct timeval timeout = {TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(fd, (struct sockaddr *)&target, sizeof(target)) < 0) {
+        close(fd);
+        return STATUS_FAILED;
+    }
+
+    size_t sent = 0;
+    while (sent < entry->len) {
+        ssize_t res = send(fd, entry->req + sent, entry->len - sent, MSG_NOSIGNAL);
+        if (res < 0 && errno != EINTR) {
+            close(fd);
+            return STATUS_FAILED;
+        }
+        sent += res > 0 ? res : 0;
+    }
+
+    //keep the start of the status line, drain the rest
+    while (1) {
+        ssize_t res = recv(fd, buf, sizeof(buf), 0);
+        if (res == 0)
+            break;
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            return STATUS_FAILED;
+        }
+        if (head_len < sizeof(head) - 1) {
+            size_t take = sizeof(head) - 1 - head_len < (size_t)res ? sizeof(head) - 1 - head_len : (size_t)res;
+            memcpy(head + head_len, buf, take);
+            head_len += take;
+        }
+    }
+    close(fd);
+
+    head[head_len] = 0;
+    int status;
+    if (sscanf(head, "HTTP/%*d.%*d %3d", &status) != 1)
+        return STATUS_BAD;
+
+    return status;
+}
+
+//sleeps until the given monotonic time in nanoseconds
+static void wait_until(uint64_t when) {
+    struct timespec ts = {(time_t)(when / 1000000000ull), (long)(when % 1000000000ull)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+//replays requests until none are left
+static void *replayer(void *arg) {
+    long i;
+    while ((i = atomic_fetch_add(&next, 1)) < entries_num) {
+        entry_t *entry = &entries[i];
+        uint64_t due = start + (uint64_t)(speed > 0 ? (double)entry->time / speed : 0);
+        if (speed > 0)
+            wait_until(due);
+
+        //back to back requests are due when they go out
+        uint64_t sent = trace_now();
+        if (speed <= 0 || due > sent)
+            due = sent;
+        entry->status = send_request(entry);
+        entry->latency = trace_now() - due;
+        entry->late = sent - due;
+    }
+
+    return NULL;
+}
+
+static int compare_key(const void *a, const void *b) {
+    const entry_t *x = (const entry_t *)a, *y = (const entry_t *)b;
+    int res = strcmp(x->key, y->key);
+    return res != 0 ? res : (x->latency > y->latency) - (x->latency < y->latency);
+}
+
+static int compare_latency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int compare_count(const void *a, const void *b) {
+    const summary_t *x = (const summary_t *)a, *y = (const summary_t *)b;
+    return (y->count > x->count) - (y->count < x->count);
+}
+
+//summarizes num requests to key from their latencies and send delays
+static void summarize(summary_t *sum, const char *key, uint64_t *latencies, uint64_t *late, long num) {
+    qsort(latencies, num, sizeof(uint64_t), compare_latency);
+    qsort(late, num, sizeof(uint64_t), compare_latency);
+    memset(sum, 0, sizeof(summary_t));
+    sum->key = key;
+    sum->count = num;
+    sum->p50 = latencies[num * 50 / 100] / 1000.0;
+    sum->p90 = latencies[num * 90 / 100] / 1000.0;
+    sum->p99 = latencies[num * 99 / 100] / 1000.0;
+    sum->max = latencies[num - 1] / 1000.0;
+    sum->late_p50 = late[num * 50 / 100] / 1000.0;
+    sum->late_p99 = late[num * 99 / 100] / 1000.0;
+    sum->late_max = late[num - 1] / 1000.0;
+}
+
+static void count(summary_t *sum, const entry_t *entry) {
+    if (entry->status < 0)
+        sum->failed++;
+    else if (entry->status >= 500)
+        sum->server_errors++;
+    else if (entry->status >= 400)
+        sum->client_errors++;
+}
+
+static void print(FILE *out, const summary_t *sum, int json) {
+    if (json)
+        fprintf(out, "{\"target\":\"%s\",\"count\":%ld,\"failed\":%ld,\"4xx\":%ld,\"5xx\":%ld,"
+            "\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,"
+            "\"late_p50_us\":%.1f,\"late_p99_us\":%.1f,\"late_max_us\":%.1f}\n",
+            sum->key, sum->count, sum->failed, sum->client_errors, sum->server_errors,
+            sum->p50, sum->p90, sum->p99, sum->max, sum->late_p50, sum->late_p99, sum->late_max);
+    else
+        fprintf(out, "%-40.40s %8ld %6ld %6ld %6ld %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+            sum->key, sum->count, sum->failed, sum->client_errors, sum->server_errors,
+            sum->p50, sum->p90, sum->p99, sum->max, sum->late_p99, sum->late_max);
+}
+
+//groups results by target and writes a summary of each
+static int report(const char *file, double elapsed) {
+    FILE *out = NULL;
+    if (file != NULL && (out = fopen(file, "w")) == NULL)
+        return -1;
+
+    uint64_t *latencies = (uint64_t *)malloc(entries_num * sizeof(uint64_t));
+    uint64_t *late = (uint64_t *)malloc(entries_num * sizeof(uint64_t));
+    summary_t *sums = (summary_t *)malloc((entries_num + 1) * sizeof(summary_t));
+    if (latencies == NULL || late == NULL || sums == NULL) {
+        free(latencies);
+        free(late);
+        free(sums);
+        if (out != NULL)
+            fclose(out);
+        return -2;
+    }
+
+    //overall distribution first
+    for (long i = 0; i < entries_num; i++) {
+        latencies[i] = entries[i].latency;
+        late[i] = entries[i].late;
+    }
+    summarize(&sums[0], "*", latencies, late, entries_num);
+    for (long i = 0; i < entries_num; i++)
+        count(&sums[0], &entries[i]);
+
+    //then one per target
+    qsort(entries, entries_num, sizeof(entry_t), compare_key);
+    int num = 1;
+    for (long from = 0, to; from < entries_num; from = to) {
+        for (to = from; to < entries_num && strcmp(entries[to].key, entries[from].key) == 0; to++) {
+            latencies[to - from] = entries[to].latency;
+            late[to - from] = entries[to].late;
+        }
+
+        summarize(&sums[num], entries[from].key, latencies, late, to - from);
+        for (long i = from; i < to; i++)
+            count(&sums[num], &entries[i]);
+        num++;
+    }
+    qsort(sums + 1, num - 1, sizeof(summary_t), compare_count);
+
+    printf("Replayed %ld requests in %.2f s (%.0f req/s)\n", entries_num, elapsed, entries_num / elapsed);
+    printf("%-40s %8s %6s %6s %6s %10s %10s %10s %10s %10s %10s\n",
+        "target", "count", "failed", "4xx", "5xx", "p50 us", "p90 us", "p99 us", "max us", "late p99", "late max");
+    for (int i = 0; i < num; i++) {
+        print(stdout, &sums[i], 0);
+        if (out != NULL)
+            print(out, &sums[i], 1);
+    }
+
+    free(latencies);
+    free(late);
+    free(sums);
+    if (out != NULL && fclose(out) != 0)
+        return -1;
+
+    return 0;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: replay [-s speed] [-c concurrency] [-a address] [-p port] [-o results] capture\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *address = "127.0.0.1", *results = NULL;
+    int port = PORT, concurrency = CONCURRENCY, opt;
+
+    while ((opt = getopt(argc, argv, "s:c:a:p:o:")) != -1) {
+        switch (opt) {
+            case 's': speed = atof(optarg); break;
+            case 'c': concurrency = atoi(optarg); break;
+            case 'a': address = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'o': results = optarg; break;
+            default: usage();
+        }
+    }
+    if (optind != argc - 1 || concurrency <= 0 || speed < 0)
+        usage();
+
+    memset(&target, 0, sizeof(target));
+    target.sin_family = AF_INET;
+    target.sin_port = htons(port);
+    if (inet_pton(AF_INET, address, &target.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address \"%s\"\n", address);
+        return 1;
+    }
+
+    if (load(argv[optind]) < 0) {
+        fprintf(stderr, "Failed to load capture \"%s\"\n", argv[optind]);
+        return 1;
+    }
+    if (entries_num == 0) {
+        fprintf(stderr, "Capture \"%s\" is empty\n", argv[optind]);
+        return 1;
+    }
+
+    pthread_t *threads = (pthread_t *)malloc(concurrency * sizeof(pthread_t));
+    if (threads == NULL)
+        return 1;
+
+    start = trace_now();
+    int started = 0;
+    for (; started < concurrency; started++)
+        if (pthread_create(&threads[started], NULL, replayer, NULL) != 0)
+            break;
+    if (started == 0) {
+        fprintf(stderr, "Failed to start replay threads\n");
+        return 1;
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    double elapsed = (trace_now() - start) / 1e9;
+    free(threads);
+
+    if (report(results, elapsed) < 0) {
+        fprintf(stderr, "Failed to write results to \"%s\"\n", results);
+        return 1;
+    }
+
+    for (long i = 0; i < entries_num; i++)
+        free(entries[i].req);
+    free(entries);
+    return 0;
+}
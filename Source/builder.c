@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "builder.h"
+#include "fiber.h"
+
+//Initializes an empty 200 OK response to client
+void builder_init(builder_t* res, int client) {
+  res->client = client;
+  res->sent = 0;
+  res->chunked = 0;
+  res->failed = 0;
+  res->head_only = 0;
+  res->status = "200 OK";
+  res->length = 0;
+  res->head_len = 0;
+  res->arena_len = 0;
+  res->iov_num = 0;
+}
+
+//Sets the status line of the response, e.g. "404 Not Found"
+//returns 0 if successful, else returns -1 if headers were already sent
+int builder_status(builder_t* res, const char* status) {
+  if (res->sent)
+    return -1;
+  res->status = status;
+  return 0;
+}
+
+//Adds a header to the response, returns 0 if successful,
+//else returns -1 if headers were already sent or do not fit
+int builder_header(builder_t* res, const char* name, const char* value) {
+  if (res->sent)
+    return -1;
+
+  size_t left = sizeof(res->head) - res->head_len;
+  int len = snprintf(res->head + res->head_len, left, "%s: %s\r\n", name, value);
+  if (len < 0 || (size_t)len >= left) {
+    res->failed = 1;
+    return -1;
+  }
+
+  res->head_len += len;
+  return 0;
+}
+
+//Appends a borrowed buffer to the body, sending it right away as a chunk
+//once streaming. Returns 0 if successful, else returns -1
+int builder_body(builder_t* res, const void* buf, size_t len) {
+  if (res->chunked)
+    return builder_chunk(res, buf, len);
+  if (len == 0)
+    return 0;
+
+  //extend previous buffer when contiguous, as with formatted text
+  if (res->iov_num > 0) {
+    struct iovec* last = &res->iov[res->iov_num - 1];
+    if ((const char*)last->iov_base + last->iov_len == (const char*)buf) {
+      last->iov_len += len;
+      res->length += len;
+      return 0;
+    }
+  }
+
+  if (res->iov_num == BUILDER_IOV) {
+    res->failed = 1;
+    return -1;
+  }
+
+  res->iov[res->iov_num].iov_base = (void*)buf;
+  res->iov[res->iov_num].iov_len = len;
+  res->iov_num++;
+  res->length += len;
+  return 0;
+}
+
+//Formats text into the response's arena and appends it to the body,
+//returns 0 if successful, else returns -1 if it does not fit
+int builder_printf(builder_t* res, const char* fmt, ...) {
+  size_t left = sizeof(res->arena) - res->arena_len;
+  char* buf = res->arena + res->arena_len;
+
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(buf, left, fmt, args);
+  va_end(args);
+
+  if (len < 0 || (size_t)len >= left) {
+    res->failed = 1;
+    return -1;
+  }
+
+  //streamed text is sent right away, so the arena can be reused
+  if (!res->chunked)
+    res->arena_len += len;
+
+  return builder_body(res, buf, len);
+}
+
+//Writes status line, headers and framing header followed by pending body
+//buffers in a single writev. Returns 0 if successful, else returns -1
+static int builder_flush(builder_t* res, const char* framing) {
+  char head[BUILDER_HEAD + 128];
+  struct iovec iov[BUILDER_IOV + 1];
+
+  int len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\n%.*s%s\r\n",
+    res->status, (int)res->head_len, res->head, framing);
+  if (len < 0 || (size_t)len >= sizeof(head))
+    return -1;
+
+  iov[0].iov_base = head;
+  iov[0].iov_len = len;
+  memcpy(&iov[1], res->iov, res->iov_num * sizeof(struct iovec));
+
+  //answers to HEAD keep the framing headers but drop the body
+  res->sent = 1;
+  return fiber_writev(res->client, iov, res->head_only ? 1 : res->iov_num + 1) < 0 ? -1 : 0;
+}
+
+//Sends buf as a chunk, sending headers with chunked transfer encoding
+//first if needed. Returns 0 if successful, else returns -1
+int builder_chunk(builder_t* res, const void* buf, size_t len) {
+  char size[32];
+  struct iovec iov[3];
+
+  if (res->sent && !res->chunked)
+    return -1;
+
+  //start streaming, body buffers queued so far become the first chunk
+  if (!res->chunked) {
+    char framing[64];
+    res->chunked = 1;
+    if (res->length > 0 && !res->head_only) {
+      snprintf(framing, sizeof(framing), "Transfer-Encoding: chunked\r\n\r\n%zx", res->length);
+      if (builder_flush(res, framing) < 0 || fiber_write(res->client, "\r\n", 2) < 0)
+        return -1;
+    }
+    else if (builder_flush(res, "Transfer-Encoding: chunked\r\n") < 0)
+      return -1;
+    res->arena_len = 0;
+  }
+
+  //zero length chunks would end the response
+  if (len == 0 || res->head_only)
+    return 0;
+
+  iov[0].iov_base = size;
+  iov[0].iov_len = snprintf(size, sizeof(size), "%zx\r\n", len);
+  iov[1].iov_base = (void*)buf;
+  iov[1].iov_len = len;
+  iov[2].iov_base = "\r\n";
+  iov[2].iov_len = 2;
+
+  return fiber_writev(res->client, iov, 3) < 0 ? -1 : 0;
+}
+
+//Completes the response, sending it in full unless already streaming.
+//Returns 0 if successful, else returns -1
+int builder_end(builder_t* res) {
+  char framing[64];
+
+  if (res->failed)
+    return -1;
+
+  if (res->chunked && res->head_only)
+    return 0;
+  if (res->chunked)
+    return fiber_write(res->client, "0\r\n\r\n", 5) < 0 ? -1 : 0;
+
+  if (res->sent)
+    return 0;
+
+  snprintf(framing, sizeof(framing), "Content-Length: %zu\r\n", res->length);
+  return builder_flush(res, framing);
+}
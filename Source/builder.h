@@ -0,0 +1,37 @@
+#ifndef BUILDER_H
+#define BUILDER_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define BUILDER_IOV     32        //body buffers per response
+#define BUILDER_HEAD    512       //bytes of status line and headers
+#define BUILDER_ARENA   2048      //bytes of formatted body text
+
+//response of a dynamic handler. Body buffers added with builder_body are
+//borrowed, not copied, and must stay valid until the response is sent
+typedef struct builder_t {
+    int client;
+    int sent;
+    int chunked;
+    int failed;
+    int head_only;
+    const char *status;
+    size_t length;
+    size_t head_len;
+    size_t arena_len;
+    int iov_num;
+    struct iovec iov[BUILDER_IOV];
+    char head[BUILDER_HEAD];
+    char arena[BUILDER_ARENA];
+} builder_t;
+
+void  builder_init(builder_t* res, int client);
+int   builder_status(builder_t* res, const char* status);
+int   builder_header(builder_t* res, const char* name, const char* value);
+int   builder_body(builder_t* res, const void* buf, size_t len);
+int   builder_printf(builder_t* res, const char* fmt, ...);
+int   builder_chunk(builder_t* res, const void* buf, size_t len);
+int   builder_end(builder_t* res);
+
+#endif
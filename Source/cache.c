@@ -0,0 +1,453 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#include "cache.h"
+#include "main.h"
+#include "fiber.h"
+#include "response.h"
+#include "trace.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY   60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY  0x4000000
+#endif
+
+#define SKETCH_ROWS   4
+#define SKETCH_MAX    15                    //counters saturate like 4 bit ones
+#define SKETCH_SAMPLE (CACHE_SKETCH * 10)   //additions before all counters are halved
+
+//cached response, header and body are stored contiguously so a hit is
+//sent with a single send. Entries stay allocated while referenced, even
+//once evicted
+typedef struct entry_t {
+    struct entry_t *next;
+    struct entry_t *newer, *older;
+    uint64_t hash;
+    char *path;
+    char *data;
+    size_t len;
+    size_t cost;
+    int refs;
+    int linked;
+
+    //file the entry was read from, checked again on hits
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    uint64_t validated;
+} entry_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static entry_t *buckets[CACHE_BUCKETS];
+static entry_t *newest = NULL, *oldest = NULL;
+static size_t bytes = 0;
+static uint64_t entries = 0;
+
+static size_t budget = CACHE_BUDGET;
+static size_t max_file = CACHE_FILE;
+static size_t zerocopy = CACHE_ZEROCOPY;
+
+//count-min sketch of recent lookups, approximating TinyLFU
+static _Atomic unsigned char sketch[SKETCH_ROWS][CACHE_SKETCH];
+static atomic_uint_fast32_t additions = 0;
+
+static atomic_uint_fast64_t hits = 0, misses = 0;
+static atomic_uint_fast64_t admitted = 0, rejected = 0, evicted = 0;
+static atomic_uint_fast64_t zerocopied = 0, copied = 0;
+
+//configures the cache, CACHE_BUDGET, CACHE_FILE and CACHE_ZEROCOPY
+//in the environment override the defaults
+void cache_init(void) {
+    char *env;
+
+    if ((env = getenv("CACHE_BUDGET")) != NULL)
+        budget = (size_t)strtoull(env, NULL, 10);
+    if ((env = getenv("CACHE_FILE")) != NULL)
+        max_file = (size_t)strtoull(env, NULL, 10);
+    if ((env = getenv("CACHE_ZEROCOPY")) != NULL)
+        zerocopy = (size_t)strtoull(env, NULL, 10);
+}
+
+//hashes a path with FNV-1a
+static uint64_t cache_hash(const char *path) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    while (*path) {
+        hash ^= (unsigned char)*path++;
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+//returns the sketch counter of hash in row
+static _Atomic unsigned char *sketch_counter(uint64_t hash, int row) {
+    uint64_t step = (hash >> 32) | 1;
+    return &sketch[row][(hash + row * step) & (CACHE_SKETCH - 1)];
+}
+
+//returns the estimated number of recent lookups of hash
+static int sketch_estimate(uint64_t hash) {
+    int min = SKETCH_MAX;
+    for (int row = 0; row < SKETCH_ROWS; row++) {
+        int cur = atomic_load_explicit(sketch_counter(hash, row), memory_order_relaxed);
+        if (cur < min)
+            min = cur;
+    }
+    return min;
+}
+
+//counts a lookup of hash, periodically halving all counters so that
+//frequencies reflect recent traffic. Concurrent updates may be lost,
+//which only makes the estimate a little lower
+static void sketch_add(uint64_t hash) {
+    int min = sketch_estimate(hash);
+    if (min < SKETCH_MAX) {
+        //only raise the smallest counters, limiting overestimation
+        for (int row = 0; row < SKETCH_ROWS; row++) {
+            _Atomic unsigned char *counter = sketch_counter(hash, row);
+            if (atomic_load_explicit(counter, memory_order_relaxed) == min)
+                atomic_store_explicit(counter, min + 1, memory_order_relaxed);
+        }
+    }
+
+    if (atomic_fetch_add_explicit(&additions, 1, memory_order_relaxed) + 1 == SKETCH_SAMPLE) {
+        for (int row = 0; row < SKETCH_ROWS; row++)
+            for (int i = 0; i < CACHE_SKETCH; i++)
+                atomic_store_explicit(&sketch[row][i],
+                    atomic_load_explicit(&sketch[row][i], memory_order_relaxed) / 2, memory_order_relaxed);
+        atomic_store_explicit(&additions, 0, memory_order_relaxed);
+    }
+}
+
+//returns the entry of path, lock must be held
+static entry_t *cache_find(uint64_t hash, const char *path) {
+    for (entry_t *entry = buckets[hash & (CACHE_BUCKETS - 1)]; entry != NULL; entry = entry->next)
+        if (entry->hash == hash && strcmp(entry->path, path) == 0)
+            return entry;
+    return NULL;
+}
+
+static void cache_free(entry_t *entry) {
+    free(entry->data);
+    free(entry->path);
+    free(entry);
+}
+
+//removes entry from the recency list, lock must be held
+static void cache_detach(entry_t *entry) {
+    if (entry->newer != NULL)
+        entry->newer->older = entry->older;
+    else
+        newest = entry->older;
+    if (entry->older != NULL)
+        entry->older->newer = entry->newer;
+    else
+        oldest = entry->newer;
+    entry->newer = entry->older = NULL;
+}
+
+//makes entry the most recently used, lock must be held
+static void cache_attach(entry_t *entry) {
+    entry->older = newest;
+    entry->newer = NULL;
+    if (newest != NULL)
+        newest->newer = entry;
+    newest = entry;
+    if (oldest == NULL)
+        oldest = entry;
+}
+
+//removes entry from the cache, freeing it unless referenced,
+//lock must be held
+static void cache_unlink(entry_t *entry) {
+    entry_t **cur = &buckets[entry->hash & (CACHE_BUCKETS - 1)];
+    while (*cur != entry)
+        cur = &(*cur)->next;
+    *cur = entry->next;
+
+    cache_detach(entry);
+    bytes -= entry->cost;
+    entries--;
+    entry->linked = 0;
+
+    if (entry->refs == 0)
+        cache_free(entry);
+}
+
+//drops a reference taken on entry
+static void cache_release(entry_t *entry) {
+    pthread_mutex_lock(&lock);
+    if (--entry->refs == 0 && !entry->linked)
+        cache_free(entry);
+    pthread_mutex_unlock(&lock);
+}
+
+//returns 1 if st describes the file entry was read from, else returns 0
+static int cache_valid(const entry_t *entry, const struct stat *st) {
+    return st->st_dev == entry->dev && st->st_ino == entry->ino && st->st_size == entry->size &&
+        st->st_mtim.tv_sec == entry->mtime.tv_sec && st->st_mtim.tv_nsec == entry->mtime.tv_nsec &&
+        st->st_uid == getuid();
+}
+
+//Sends buf with MSG_ZEROCOPY, then waits for the kernel to report that it
+//no longer references buf. Returns 0 if successful, else returns -1
+static int cache_zerocopy(int client, const char *buf, size_t len) {
+    uint32_t calls = 0, done = 0;
+    size_t total = 0;
+    int res = 0;
+
+    while (total < len) {
+        ssize_t sent = send(client, buf + total, len - total, MSG_ZEROCOPY | MSG_NOSIGNAL);
+        if (sent > 0) {
+            total += sent;
+            calls++;
+            continue;
+        }
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && fiber_wait(client, EPOLLOUT) == 0)
+            continue;
+
+        //out of memory the socket may pin, copy the rest
+        if (sent < 0 && errno == ENOBUFS && fiber_write(client, buf + total, len - total) >= 0)
+            break;
+
+        res = -1;
+        break;
+    }
+
+    //each send is acknowledged on the error queue, possibly several at once
+    while (done < calls) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(client, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && fiber_wait(client, EPOLLERR) == 0)
+                continue;
+            return -1;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            done += err->ee_data - err->ee_info + 1;
+
+            //the kernel fell back to copying, e.g. over loopback
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                atomic_fetch_add_explicit(&copied, 1, memory_order_relaxed);
+        }
+    }
+
+    return res;
+}
+
+//sends the cached response of entry to client,
+//returns 0 if successful, else returns -1
+static int cache_write(int client, const entry_t *entry) {
+    int enable = 1;
+
+    //small responses are cheaper to copy than to pin and track
+    if (entry->len >= zerocopy && setsockopt(client, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(int)) == 0) {
+        atomic_fetch_add_explicit(&zerocopied, 1, memory_order_relaxed);
+        return cache_zerocopy(client, entry->data, entry->len);
+    }
+
+    return fiber_write(client, entry->data, entry->len) < 0 ? -1 : 0;
+}
+
+//Serves path from the cache if it is cached and unchanged, counting the
+//lookup towards admission. Returns 0 if it was served, 1 if it is not
+//cached, else returns -1 if sending failed
+int cache_send(int client, const char *path) {
+    if (budget == 0)
+        return 1;
+
+    uint64_t hash = cache_hash(path);
+    sketch_add(hash);
+
+    pthread_mutex_lock(&lock);
+    entry_t *entry = cache_find(hash, path);
+    if (entry == NULL) {
+        pthread_mutex_unlock(&lock);
+        atomic_fetch_add_explicit(&misses, 1, memory_order_relaxed);
+        return 1;
+    }
+
+    cache_detach(entry);
+    cache_attach(entry);
+    entry->refs++;
+
+    //check the file again once in a while, one request at a time
+    uint64_t now = trace_now();
+    int check = now - entry->validated > CACHE_REVALIDATE;
+    if (check)
+        entry->validated = now;
+    pthread_mutex_unlock(&lock);
+
+    struct stat st;
+    if (check && (stat(path, &st) < 0 || !cache_valid(entry, &st))) {
+        pthread_mutex_lock(&lock);
+        if (entry->linked)
+            cache_unlink(entry);
+        pthread_mutex_unlock(&lock);
+        cache_release(entry);
+        atomic_fetch_add_explicit(&misses, 1, memory_order_relaxed);
+        return 1;
+    }
+
+    atomic_fetch_add_explicit(&hits, 1, memory_order_relaxed);
+    int res = cache_write(client, entry);
+    cache_release(entry);
+    return res;
+}
+
+//returns 1 if an entry of cost looked up freq times should replace the
+//least recently used entries it needs room from, else returns 0.
+//lock must be held
+static int cache_admit(size_t cost, int freq) {
+    size_t room = bytes;
+    for (entry_t *victim = oldest; victim != NULL && room + cost > budget; victim = victim->newer) {
+        if (sketch_estimate(victim->hash) >= freq)
+            return 0;
+        room -= victim->cost;
+    }
+    return room + cost <= budget;
+}
+
+//Reads the open file at path into the cache and serves it from there, if
+//it is small enough and looked up more often than the entries it would
+//evict. Returns 0 if it was served, 1 if it was not admitted, else
+//returns -1 if sending failed
+int cache_insert(int client, const char *path, int file, const mime_t *mime, off_t size) {
+    char head[BUFFER];
+    struct stat st;
+
+    if (budget == 0 || size < 0 || (size_t)size > max_file || fstat(file, &st) < 0 || st.st_size != size)
+        return 1;
+
+    int head_len = render_header(head, sizeof(head), mime->type, size);
+    if (head_len < 0)
+        return 1;
+
+    size_t len = head_len + size;
+    size_t path_len = strlen(path);
+    size_t cost = sizeof(entry_t) + path_len + 1 + len;
+    uint64_t hash = cache_hash(path);
+    int freq = sketch_estimate(hash);
+
+    //check before reading the file, so one-off requests cost no copies
+    pthread_mutex_lock(&lock);
+    int admit = cache_find(hash, path) == NULL && cache_admit(cost, freq);
+    pthread_mutex_unlock(&lock);
+    if (!admit) {
+        atomic_fetch_add_explicit(&rejected, 1, memory_order_relaxed);
+        return 1;
+    }
+
+    entry_t *entry = (entry_t *)calloc(1, sizeof(entry_t));
+    if (entry == NULL)
+        return 1;
+    entry->path = (char *)malloc(path_len + 1);
+    entry->data = (char *)malloc(len);
+    if (entry->path == NULL || entry->data == NULL) {
+        cache_free(entry);
+        return 1;
+    }
+
+    memcpy(entry->path, path, path_len + 1);
+    memcpy(entry->data, head, head_len);
+    for (off_t read = 0; read < size;) {
+        ssize_t res = pread(file, entry->data + head_len + read, size - read, read);
+        if (res <= 0) {
+            cache_free(entry);
+            return 1;
+        }
+        read += res;
+    }
+
+    entry->hash = hash;
+    entry->len = len;
+    entry->cost = cost;
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtim;
+    entry->validated = trace_now();
+
+    //others may have filled the cache meanwhile, so check again
+    pthread_mutex_lock(&lock);
+    if (cache_find(hash, path) != NULL || !cache_admit(cost, freq)) {
+        pthread_mutex_unlock(&lock);
+        cache_free(entry);
+        atomic_fetch_add_explicit(&rejected, 1, memory_order_relaxed);
+        return 1;
+    }
+
+    while (bytes + cost > budget) {
+        cache_unlink(oldest);
+        atomic_fetch_add_explicit(&evicted, 1, memory_order_relaxed);
+    }
+
+    entry_t **bucket = &buckets[hash & (CACHE_BUCKETS - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    cache_attach(entry);
+    entry->linked = 1;
+    entry->refs = 1;
+    bytes += cost;
+    entries++;
+    pthread_mutex_unlock(&lock);
+    atomic_fetch_add_explicit(&admitted, 1, memory_order_relaxed);
+
+    int res = cache_write(client, entry);
+    cache_release(entry);
+    return res;
+}
+
+//copies the cache's counters into stats
+void cache_stats(cache_stats_t *stats) {
+    stats->hits = atomic_load_explicit(&hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&misses, memory_order_relaxed);
+    stats->admitted = atomic_load_explicit(&admitted, memory_order_relaxed);
+    stats->rejected = atomic_load_explicit(&rejected, memory_order_relaxed);
+    stats->evicted = atomic_load_explicit(&evicted, memory_order_relaxed);
+    stats->zerocopy = atomic_load_explicit(&zerocopied, memory_order_relaxed);
+    stats->copied = atomic_load_explicit(&copied, memory_order_relaxed);
+    stats->budget = budget;
+
+    pthread_mutex_lock(&lock);
+    stats->entries = entries;
+    stats->bytes = bytes;
+    pthread_mutex_unlock(&lock);
+}
+
+//frees every cached entry, no requests may be in flight
+void cache_destroy(void) {
+    pthread_mutex_lock(&lock);
+    while (oldest != NULL)
+        cache_unlink(oldest);
+    pthread_mutex_unlock(&lock);
+}
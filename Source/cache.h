@@ -0,0 +1,37 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "mime.h"
+
+#define CACHE_BUDGET      (16 * 1024 * 1024)  //bytes of headers and bodies kept, 0 disables the cache
+#define CACHE_FILE        (256 * 1024)        //files larger than this are not cached
+#define CACHE_ZEROCOPY    (16 * 1024)         //responses at least this large are sent with MSG_ZEROCOPY
+#define CACHE_REVALIDATE  1000000000ull       //nanoseconds before a hit checks the file again
+#define CACHE_BUCKETS     4096                //hash table buckets, power of 2
+#define CACHE_SKETCH      4096                //counters in each row of the frequency sketch, power of 2
+
+//snapshot of cache counters for the status route
+typedef struct cache_stats_t {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t admitted;
+    uint64_t rejected;
+    uint64_t evicted;
+    uint64_t zerocopy;
+    uint64_t copied;
+    uint64_t entries;
+    uint64_t bytes;
+    uint64_t budget;
+} cache_stats_t;
+
+void  cache_init(void);
+int   cache_send(int client, const char* path);
+int   cache_insert(int client, const char* path, int file, const mime_t* mime, off_t size);
+void  cache_stats(cache_stats_t* stats);
+void  cache_destroy(void);
+
+#endif
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+
+#include "capture.h"
+
+static FILE *out = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t epoch = 0;
+static uint64_t records = 0;
+
+//Opens the capture file named by CAPTURE_FILE in the environment, if any.
+//Must be called before changing root, so the path is relative to the
+//directory the server was started from. Returns 0 if successful or
+//capture is disabled, else returns -1
+int capture_init(void) {
+    char *env = getenv("CAPTURE_FILE");
+    if (env == NULL || *env == 0)
+        return 0;
+
+    out = fopen(env, "wb");
+    if (out == NULL)
+        return -1;
+
+    setvbuf(out, NULL, _IOFBF, CAPTURE_BUFFER);
+    if (fwrite(CAPTURE_MAGIC, 1, 8, out) != 8) {
+        fclose(out);
+        out = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+//Appends a request that arrived at the given monotonic time, keeping only
+//its request line and headers
+void capture_request(uint64_t arrival, const char* req, size_t len) {
+    if (out == NULL || len == 0)
+        return;
+
+    //drop the body, replay resends the head only
+    const char *end = strstr(req, "\r\n\r\n");
+    if (end != NULL && (size_t)(end - req) + 4 < len)
+        len = end - req + 4;
+    if (len > CAPTURE_MAX)
+        len = CAPTURE_MAX;
+
+    pthread_mutex_lock(&lock);
+
+    //requests are read after queueing, so times may be slightly out of order
+    if (records++ == 0)
+        epoch = arrival;
+    uint64_t time = arrival > epoch ? arrival - epoch : 0;
+
+    capture_record_t record = {htole64(time), htole32((uint32_t)len), 0};
+    fwrite(&record, sizeof(record), 1, out);
+    fwrite(req, 1, len, out);
+
+    pthread_mutex_unlock(&lock);
+}
+
+//flushes and closes the capture file
+void capture_close(void) {
+    pthread_mutex_lock(&lock);
+    if (out != NULL) {
+        printf("Captured %llu requests\n", (unsigned long long)records);
+        fclose(out);
+        out = NULL;
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,26 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "main.h"
+
+#define CAPTURE_MAGIC   "MSCAP001"      //first bytes of a capture file
+#define CAPTURE_MAX     BUFFER          //bytes of request head kept per record, all that is read
+#define CAPTURE_BUFFER  (64 * 1024)     //bytes buffered before writing
+
+//Capture files start with CAPTURE_MAGIC, followed by one record per
+//request in arrival order, each a capture_record_t header and len bytes of the
+//request line and headers. Fields are stored little endian
+typedef struct capture_record_t {
+    uint64_t time;    //nanoseconds since the first captured request
+    uint32_t len;     //bytes of request head following the header
+    uint32_t flags;   //reserved, written as 0
+} capture_record_t;
+
+int   capture_init(void);
+void  capture_request(uint64_t arrival, const char* req, size_t len);
+void  capture_close(void);
+
+#endif
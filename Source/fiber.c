@@ -0,0 +1,448 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/sendfile.h>
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+#include "fiber.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+//user space thread with its own mmap'd stack
+typedef struct fiber_t {
+#if defined(__x86_64__)
+    void *sp;
+#else
+    ucontext_t ctx;
+#endif
+    void *stack;
+    fiber_fn routine;
+    void *args;
+    int done;
+    struct fiber_t *next;
+} fiber_t;
+
+//per worker scheduler, fibers never migrate between workers
+typedef struct scheduler_t {
+#if defined(__x86_64__)
+    void *sp;
+#else
+    ucontext_t ctx;
+#endif
+    fiber_t *current;
+    fiber_t *ready;
+    fiber_t *ready_tail;
+    fiber_t *cache;
+    int cached;
+    int parked;
+    int epfd;
+    int wakefd;
+} scheduler_t;
+
+static __thread scheduler_t *sched = NULL;
+static size_t page = 0;
+
+#if defined(__x86_64__)
+//saves callee saved registers on the current stack, stores the stack
+//pointer in *from and resumes the stack at to
+void fiber_switch(void **from, void *to);
+__asm__(
+    ".text\n"
+    ".globl fiber_switch\n"
+    ".type fiber_switch, @function\n"
+    "fiber_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size fiber_switch, .-fiber_switch\n");
+#endif
+
+//switches from the scheduler into fiber
+static void fiber_enter(fiber_t *fiber) {
+    sched->current = fiber;
+#if defined(__x86_64__)
+    fiber_switch(&sched->sp, fiber->sp);
+#else
+    swapcontext(&sched->ctx, &fiber->ctx);
+#endif
+    sched->current = NULL;
+}
+
+//switches from the running fiber back to the scheduler
+static void fiber_leave(fiber_t *fiber) {
+#if defined(__x86_64__)
+    fiber_switch(&fiber->sp, sched->sp);
+#else
+    swapcontext(&fiber->ctx, &sched->ctx);
+#endif
+}
+
+//first function run on a fiber's stack
+static void fiber_entry(void) {
+    fiber_t *fiber = sched->current;
+    (fiber->routine)(fiber->args);
+
+    //never resumed once done
+    fiber->done = 1;
+    fiber_leave(fiber);
+}
+
+//allocates a fiber, reusing a cached stack when available
+//else returns NULL
+static fiber_t *fiber_create(fiber_fn fn, void *arg) {
+    fiber_t *fiber = sched->cache;
+    if (fiber != NULL) {
+        sched->cache = fiber->next;
+        sched->cached--;
+    }
+    else {
+        fiber = (fiber_t *)malloc(sizeof(fiber_t));
+        if (fiber == NULL)
+            return NULL;
+
+        //map stack with an inaccessible guard page below it
+        fiber->stack = mmap(NULL, FIBER_STACK + page, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (fiber->stack == MAP_FAILED) {
+            free(fiber);
+            return NULL;
+        }
+        if (mprotect(fiber->stack, page, PROT_NONE) < 0) {
+            munmap(fiber->stack, FIBER_STACK + page);
+            free(fiber);
+            return NULL;
+        }
+    }
+
+    fiber->routine = fn;
+    fiber->args = arg;
+    fiber->done = 0;
+    fiber->next = NULL;
+
+#if defined(__x86_64__)
+    //lay out a frame for fiber_switch to pop, returning into fiber_entry
+    //with the stack aligned as if it had been called
+    uint64_t *top = (uint64_t *)((char *)fiber->stack + page + FIBER_STACK);
+    top[-1] = 0;
+    top[-2] = (uint64_t)fiber_entry;
+    memset(&top[-8], 0, 6 * sizeof(uint64_t));
+    fiber->sp = &top[-8];
+#else
+    getcontext(&fiber->ctx);
+    fiber->ctx.uc_stack.ss_sp = (char *)fiber->stack + page;
+    fiber->ctx.uc_stack.ss_size = FIBER_STACK;
+    fiber->ctx.uc_link = NULL;
+    makecontext(&fiber->ctx, fiber_entry, 0);
+#endif
+
+    return fiber;
+}
+
+//returns a finished fiber's stack to the cache, or unmaps it
+static void fiber_free(fiber_t *fiber) {
+    if (sched->cached < FIBER_CACHE) {
+        fiber->next = sched->cache;
+        sched->cache = fiber;
+        sched->cached++;
+        return;
+    }
+
+    munmap(fiber->stack, FIBER_STACK + page);
+    free(fiber);
+}
+
+//resumes fiber until it parks, yields or finishes
+static void fiber_resume(fiber_t *fiber) {
+    fiber_enter(fiber);
+    if (fiber->done)
+        fiber_free(fiber);
+}
+
+//Initializes the calling worker's scheduler. Events on wakefd interrupt
+//fiber_poll. Returns 0 if successful, else returns a negative value
+int fiber_init(int wakefd) {
+    if (page == 0)
+        page = (size_t)sysconf(_SC_PAGESIZE);
+
+    sched = (scheduler_t *)calloc(1, sizeof(scheduler_t));
+    if (sched == NULL)
+        return -1;
+
+    sched->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (sched->epfd < 0) {
+        free(sched);
+        sched = NULL;
+        return -2;
+    }
+
+    //wake events carry no fiber
+    sched->wakefd = wakefd;
+    if (wakefd >= 0) {
+        struct epoll_event ev = {EPOLLIN, {NULL}};
+        if (epoll_ctl(sched->epfd, EPOLL_CTL_ADD, wakefd, &ev) < 0) {
+            fiber_destroy();
+            return -3;
+        }
+    }
+
+    return 0;
+}
+
+//Frees the calling worker's scheduler and cached stacks
+void fiber_destroy(void) {
+    if (sched == NULL)
+        return;
+
+    while (sched->cache != NULL) {
+        fiber_t *fiber = sched->cache;
+        sched->cache = fiber->next;
+        munmap(fiber->stack, FIBER_STACK + page);
+        free(fiber);
+    }
+
+    close(sched->epfd);
+    free(sched);
+    sched = NULL;
+}
+
+//Runs fn on a new fiber until it finishes or blocks,
+//returns 0 if successful, else returns a negative value
+int fiber_run(fiber_fn fn, void *arg) {
+    fiber_t *fiber = fiber_create(fn, arg);
+    if (fiber == NULL)
+        return -1;
+
+    fiber_resume(fiber);
+    return 0;
+}
+
+//Resumes yielded fibers, then waits up to timeout milliseconds for parked
+//fibers to become ready and resumes them. Returns the number of fibers
+//resumed, else returns a negative value
+int fiber_poll(int timeout) {
+    struct epoll_event events[FIBER_EVENTS];
+    int resumed = 0;
+
+    //run fibers that yielded, ones yielding again wait for the next poll
+    fiber_t *ready = sched->ready;
+    sched->ready = sched->ready_tail = NULL;
+    while (ready != NULL) {
+        fiber_t *next = ready->next;
+        ready->next = NULL;
+        fiber_resume(ready);
+        ready = next;
+        resumed++;
+    }
+
+    if (sched->ready != NULL || resumed > 0)
+        timeout = 0;
+
+    int num = epoll_wait(sched->epfd, events, FIBER_EVENTS, timeout);
+    if (num < 0)
+        return errno == EINTR ? resumed : -1;
+
+    for (int i = 0; i < num; i++) {
+        fiber_t *fiber = (fiber_t *)events[i].data.ptr;
+
+        //drain wake ups, the worker checks its queue after polling
+        if (fiber == NULL) {
+            uint64_t count;
+            if (read(sched->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                return -2;
+            continue;
+        }
+
+        sched->parked--;
+        fiber_resume(fiber);
+        resumed++;
+    }
+
+    return resumed;
+}
+
+//Returns the number of fibers of the calling worker that are parked
+//or yielded and still need to be resumed
+int fiber_pending(void) {
+    if (sched == NULL)
+        return 0;
+    return sched->parked + (sched->ready != NULL);
+}
+
+//Yields the running fiber, letting the worker run others before resuming it
+void fiber_yield(void) {
+    fiber_t *fiber = sched != NULL ? sched->current : NULL;
+    if (fiber == NULL) {
+        sched_yield();
+        return;
+    }
+
+    if (sched->ready_tail != NULL)
+        sched->ready_tail->next = fiber;
+    else
+        sched->ready = fiber;
+    sched->ready_tail = fiber;
+
+    fiber_leave(fiber);
+}
+
+//Parks the running fiber for ns nanoseconds,
+//returns 0 if successful, else returns a negative value
+int fiber_sleep(uint64_t ns) {
+    struct itimerspec when = {{0, 0}, {ns / 1000000000ull, ns % 1000000000ull}};
+    if (ns == 0)
+        return 0;
+
+    //not on a fiber, sleep the thread instead
+    if (sched == NULL || sched->current == NULL) {
+        while (nanosleep(&when.it_value, &when.it_value) < 0)
+            if (errno != EINTR)
+                return -1;
+        return 0;
+    }
+
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer < 0)
+        return -1;
+
+    int res = timerfd_settime(timer, 0, &when, NULL) < 0 ? -2 : fiber_wait(timer, EPOLLIN);
+    close(timer);
+
+    return res;
+}
+
+//Parks the running fiber until fd has any of events pending,
+//returns 0 if successful, else returns a negative value
+int fiber_wait(int fd, uint32_t events) {
+    fiber_t *fiber = sched != NULL ? sched->current : NULL;
+
+    //not on a fiber, block the thread instead
+    if (fiber == NULL) {
+        struct pollfd pfd = {fd, (short)events, 0};
+        while (poll(&pfd, 1, -1) < 0)
+            if (errno != EINTR)
+                return -1;
+        return 0;
+    }
+
+    //register fd for a single wake up of this fiber
+    struct epoll_event ev;
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = fiber;
+    if (epoll_ctl(sched->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        if (errno != ENOENT || epoll_ctl(sched->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            return -2;
+    }
+
+    sched->parked++;
+    fiber_leave(fiber);
+
+    return 0;
+}
+
+//Reads up to len bytes from fd, parking while none are available.
+//Returns the number of bytes read, else returns -1
+ssize_t fiber_read(int fd, void *buf, size_t len) {
+    while (1) {
+        ssize_t res = read(fd, buf, len);
+        if (res >= 0)
+            return res;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        if (fiber_wait(fd, EPOLLIN | EPOLLRDHUP) < 0)
+            return -1;
+    }
+}
+
+//Writes all len bytes to fd, parking whenever it would block.
+//Returns len if successful, else returns -1
+ssize_t fiber_write(int fd, const void *buf, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t res = write(fd, (const char *)buf + total, len - total);
+        if (res > 0) {
+            total += res;
+            continue;
+        }
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            return -1;
+        if (fiber_wait(fd, EPOLLOUT) < 0)
+            return -1;
+    }
+    return total;
+}
+
+//Writes all count buffers of iov to fd, parking whenever it would block.
+//iov is advanced past written data. Returns the number of bytes written,
+//else returns -1
+ssize_t fiber_writev(int fd, struct iovec *iov, int count) {
+    size_t total = 0;
+    while (count > 0) {
+        ssize_t res = writev(fd, iov, count > IOV_MAX ? IOV_MAX : count);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            if (fiber_wait(fd, EPOLLOUT) < 0)
+                return -1;
+            continue;
+        }
+        total += res;
+
+        //skip buffers written in full, then trim the partial one
+        while (count > 0 && (size_t)res >= iov->iov_len) {
+            res -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + res;
+            iov->iov_len -= res;
+        }
+    }
+    return total;
+}
+
+//Sends up to len bytes of in to out, parking while out would block.
+//Returns the number of bytes sent, else returns -1
+ssize_t fiber_sendfile(int out, int in, off_t *offset, size_t len) {
+    while (1) {
+        ssize_t res = sendfile(out, in, offset, len);
+        if (res >= 0)
+            return res;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        if (fiber_wait(out, EPOLLOUT) < 0)
+            return -1;
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef FIBER_H
+#define FIBER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define FIBER_STACK   (64 * 1024)     //usable stack of each fiber
+#define FIBER_CACHE   64              //free stacks kept by each worker
+#define FIBER_EVENTS  64              //events handled per epoll_wait
+
+typedef void (*fiber_fn)(void *);
+
+//scheduler, one per worker thread
+int     fiber_init(int wakefd);
+void    fiber_destroy(void);
+int     fiber_run(fiber_fn fn, void *arg);
+int     fiber_poll(int timeout);
+int     fiber_pending(void);
+
+//calls made from within a fiber, these fall back to blocking when
+//called from a plain thread
+void    fiber_yield(void);
+int     fiber_sleep(uint64_t ns);
+int     fiber_wait(int fd, uint32_t events);
+ssize_t fiber_read(int fd, void *buf, size_t len);
+ssize_t fiber_write(int fd, const void *buf, size_t len);
+ssize_t fiber_writev(int fd, struct iovec *iov, int count);
+ssize_t fiber_sendfile(int out, int in, off_t *offset, size_t len);
+
+#endif
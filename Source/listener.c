@@ -0,0 +1,307 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "listener.h"
+#include "main.h"
+
+static listener_t listeners[LISTENERS];
+static int listeners_num = 0;
+
+//parses a non negative option value, returns -1 if it is not one
+static int listener_number(const char *value, int base) {
+    char *end;
+    if (value == NULL || *value == 0)
+        return -1;
+
+    long num = strtol(value, &end, base);
+    if (*end != 0 || num < 0 || num > 0x7fffffff)
+        return -1;
+    return (int)num;
+}
+
+//applies a comma separated option list to listener,
+//returns 0 if successful, else returns -1
+static int listener_options(listener_t *listener, char *options) {
+    char *save = NULL;
+
+    for (char *opt = strtok_r(options, ",", &save); opt != NULL; opt = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(opt, '=');
+        if (value != NULL)
+            *value++ = 0;
+
+        //flags take no value, the others need a valid one
+        int num = listener_number(value, strcmp(opt, "mode") == 0 ? 8 : 10);
+        int flag = strcmp(opt, "reuseport") == 0 || strcmp(opt, "nodelay") == 0 || strcmp(opt, "v6only") == 0;
+        if (flag ? value != NULL : num < 0)
+            return -1;
+
+        if (strcmp(opt, "backlog") == 0 && num > 0)
+            listener->backlog = num;
+        else if (strcmp(opt, "reuseport") == 0)
+            listener->reuseport = 1;
+        else if (strcmp(opt, "nodelay") == 0)
+            listener->nodelay = 1;
+        else if (strcmp(opt, "defer") == 0)
+            listener->defer = num;
+        else if (strcmp(opt, "fastopen") == 0)
+            listener->fastopen = num;
+        else if (strcmp(opt, "rcvbuf") == 0)
+            listener->rcvbuf = num;
+        else if (strcmp(opt, "sndbuf") == 0)
+            listener->sndbuf = num;
+        else if (strcmp(opt, "v6only") == 0)
+            listener->v6only = 1;
+        else if (strcmp(opt, "mode") == 0)
+            listener->mode = num;
+        else
+            return -1;
+    }
+
+    return 0;
+}
+
+//parses one endpoint into listener, returns 0 if successful, else returns -1
+static int listener_parse(listener_t *listener, char *spec) {
+    memset(listener, 0, sizeof(listener_t));
+    snprintf(listener->name, sizeof(listener->name), "%s", spec);
+    listener->fd = -1;
+    listener->backlog = LISTEN_BACKLOG;
+    listener->reuseport = listener->nodelay = listener->v6only = 0;
+    listener->defer = listener->fastopen = listener->rcvbuf = listener->sndbuf = listener->mode = -1;
+
+    char *options = strchr(spec, '?');
+    if (options != NULL) {
+        *options++ = 0;
+        if ((size_t)(options - spec - 1) < sizeof(listener->name))
+            listener->name[options - spec - 1] = 0;
+        if (listener_options(listener, options) < 0)
+            return -1;
+    }
+
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un *addr = (struct sockaddr_un *)&listener->addr;
+        const char *path = spec + 5;
+        size_t len = strlen(path);
+        if (len == 0 || len >= sizeof(addr->sun_path))
+            return -1;
+
+        addr->sun_family = AF_UNIX;
+        memcpy(addr->sun_path, path, len);
+        listener->addr_len = offsetof(struct sockaddr_un, sun_path) + len;
+
+        //abstract sockets are named by a leading NUL instead of @
+        if (path[0] == '@')
+            addr->sun_path[0] = 0;
+        else
+            listener->addr_len++;
+
+        listener->family = AF_UNIX;
+        return 0;
+    }
+
+    //split port off at the last colon
+    int v6 = strncmp(spec, "tcp6:", 5) == 0;
+    if (!v6 && strncmp(spec, "tcp4:", 5) != 0)
+        return -1;
+
+    char *host = spec + 5;
+    char *port = strrchr(host, ':');
+    if (port == NULL)
+        return -1;
+    *port++ = 0;
+
+    int num = listener_number(port, 10);
+    if (num < 0 || num > 65535)
+        return -1;
+
+    if (v6) {
+        struct sockaddr_in6 *addr = (struct sockaddr_in6 *)&listener->addr;
+        size_t len = strlen(host);
+        if (len < 2 || host[0] != '[' || host[len - 1] != ']')
+            return -1;
+        host[len - 1] = 0;
+
+        addr->sin6_family = AF_INET6;
+        addr->sin6_port = htons(num);
+        if (inet_pton(AF_INET6, host + 1, &addr->sin6_addr) != 1)
+            return -1;
+        listener->addr_len = sizeof(struct sockaddr_in6);
+        listener->family = AF_INET6;
+    }
+    else {
+        struct sockaddr_in *addr = (struct sockaddr_in *)&listener->addr;
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons(num);
+        if (*host == 0)
+            addr->sin_addr.s_addr = INADDR_ANY;
+        else if (inet_pton(AF_INET, host, &addr->sin_addr) != 1)
+            return -1;
+        listener->addr_len = sizeof(struct sockaddr_in);
+        listener->family = AF_INET;
+    }
+
+    return 0;
+}
+
+//Parses the endpoints given by LISTEN in the environment, by default
+//every IPv4 address on PORT. Returns 0 if successful, else returns -1
+int listener_init(void) {
+    char spec[LISTENERS * LISTEN_NAME];
+    char *env = getenv("LISTEN");
+    char *save = NULL;
+
+    if (env != NULL && *env != 0)
+        snprintf(spec, sizeof(spec), "%s", env);
+    else
+        snprintf(spec, sizeof(spec), "tcp4:0.0.0.0:%i", PORT);
+
+    listeners_num = 0;
+    for (char *cur = strtok_r(spec, " \t", &save); cur != NULL; cur = strtok_r(NULL, " \t", &save)) {
+        if (listeners_num == LISTENERS) {
+            fprintf(stderr, "More than %i listeners\n", LISTENERS);
+            return -1;
+        }
+        //parsing splits the endpoint up, keep it whole for the error
+        char endpoint[LISTENERS * LISTEN_NAME];
+        snprintf(endpoint, sizeof(endpoint), "%s", cur);
+        if (listener_parse(&listeners[listeners_num], cur) < 0) {
+            fprintf(stderr, "Invalid listener \"%s\"\n", endpoint);
+            return -1;
+        }
+        listeners_num++;
+    }
+
+    return listeners_num > 0 ? 0 : -1;
+}
+
+//sets an integer socket option if it was configured
+static int listener_option(int fd, int level, int name, int value) {
+    if (value < 0)
+        return 0;
+    return setsockopt(fd, level, name, &value, sizeof(int));
+}
+
+//creates, configures, binds and listens on one endpoint,
+//returns 0 if successful, else returns a negative value
+static int listener_bind(listener_t *listener) {
+    int enable = 1;
+    int tcp = listener->family != AF_UNIX;
+
+    listener->fd = socket(listener->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener->fd < 0)
+        return -1;
+
+    //configure socket for immediate reuse after server termination
+    if (tcp && setsockopt(listener->fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0)
+        return -2;
+
+    if ((tcp && listener->reuseport && setsockopt(listener->fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0) ||
+        listener_option(listener->fd, SOL_SOCKET, SO_RCVBUF, listener->rcvbuf) < 0 ||
+        listener_option(listener->fd, SOL_SOCKET, SO_SNDBUF, listener->sndbuf) < 0)
+        return -2;
+
+    //accepted sockets inherit these from the listening one
+    if (tcp && ((listener->nodelay && setsockopt(listener->fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int)) < 0) ||
+        listener_option(listener->fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, listener->defer) < 0 ||
+        listener_option(listener->fd, IPPROTO_TCP, TCP_FASTOPEN, listener->fastopen) < 0))
+        return -2;
+
+    //serve IPv4 clients as mapped addresses unless asked not to
+    if (listener->family == AF_INET6 &&
+        setsockopt(listener->fd, IPPROTO_IPV6, IPV6_V6ONLY, &listener->v6only, sizeof(int)) < 0)
+        return -2;
+
+    //replace socket file left behind by a previous run
+    struct sockaddr_un *unix_addr = (struct sockaddr_un *)&listener->addr;
+    int named = !tcp && unix_addr->sun_path[0] != 0;
+    if (named)
+        unlink(unix_addr->sun_path);
+
+    if (bind(listener->fd, (struct sockaddr *)&listener->addr, listener->addr_len) < 0)
+        return -3;
+
+    //workers run as an unprivileged user, clients may need wider access
+    if (named && listener->mode >= 0 && chmod(unix_addr->sun_path, listener->mode) < 0)
+        return -4;
+
+    if (listen(listener->fd, listener->backlog) < 0)
+        return -5;
+
+    return 0;
+}
+
+//Binds and listens on every configured endpoint,
+//returns 0 if successful, else returns a negative value
+int listener_open(void) {
+    for (int i = 0; i < listeners_num; i++) {
+        printf("--listening on %s, backlog %i\n", listeners[i].name, listeners[i].backlog);
+        int res = listener_bind(&listeners[i]);
+        if (res < 0) {
+            perror(listeners[i].name);
+            return res;
+        }
+    }
+
+    return 0;
+}
+
+//returns the number of configured endpoints
+int listener_count(void) { return listeners_num; }
+
+//returns the endpoint at index
+listener_t *listener_get(int index) { return &listeners[index]; }
+
+//Accepts a pending connection as a non blocking socket and counts it,
+//returns its descriptor, else returns -1 if none is pending
+int listener_accept(listener_t *listener, struct sockaddr_storage *addr, socklen_t *len) {
+    *len = sizeof(struct sockaddr_storage);
+    int fd = accept4(listener->fd, (struct sockaddr *)addr, len, SOCK_NONBLOCK);
+    if (fd >= 0) {
+        atomic_fetch_add_explicit(&listener->accepted, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&listener->active, 1, memory_order_relaxed);
+    }
+    return fd;
+}
+
+//counts a connection of listener that was closed before being handled,
+//limited tells whether it was over its rate limit
+void listener_refuse(listener_t *listener, int limited) {
+    atomic_fetch_sub_explicit(&listener->active, 1, memory_order_relaxed);
+    if (limited)
+        atomic_fetch_add_explicit(&listener->limited, 1, memory_order_relaxed);
+}
+
+//counts a connection of listener that was closed after elapsed nanoseconds
+void listener_done(listener_t *listener, uint64_t elapsed) {
+    atomic_fetch_sub_explicit(&listener->active, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&listener->served, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&listener->busy, elapsed, memory_order_relaxed);
+}
+
+//closes every endpoint, removing socket files
+void listener_close(void) {
+    for (int i = 0; i < listeners_num; i++) {
+        listener_t *listener = &listeners[i];
+        if (listener->fd < 0)
+            continue;
+
+        close(listener->fd);
+        listener->fd = -1;
+
+        //the server has dropped root by now, this may fail
+        struct sockaddr_un *addr = (struct sockaddr_un *)&listener->addr;
+        if (listener->family == AF_UNIX && addr->sun_path[0] != 0)
+            unlink(addr->sun_path);
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#define LISTENERS       8                 //endpoints bound at once
+#define LISTEN_BACKLOG  128               //pending connections per endpoint
+#define LISTEN_BATCH    32                //connections accepted per endpoint in a turn
+#define LISTEN_NAME     128               //bytes of an endpoint's description
+
+//Endpoint the server accepts connections on, configured with LISTEN in the
+//environment as a space separated list of
+//  tcp4:ADDRESS:PORT     e.g. tcp4:0.0.0.0:80
+//  tcp6:[ADDRESS]:PORT   dual stack unless v6only is given, e.g. tcp6:[::]:80
+//  unix:PATH             relative to the webroot, or unix:@NAME for the
+//                        abstract namespace
+//each optionally followed by ?OPTION,OPTION... out of backlog=N,
+//reuseport, nodelay, defer=SECONDS, fastopen=N, rcvbuf=N, sndbuf=N,
+//v6only and mode=OCTAL
+typedef struct listener_t {
+    int fd;
+    int family;
+    char name[LISTEN_NAME];
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    //socket options, negative when unset
+    int backlog;
+    int reuseport;
+    int nodelay;
+    int defer;
+    int fastopen;
+    int rcvbuf;
+    int sndbuf;
+    int v6only;
+    int mode;
+
+    //connection counters
+    atomic_ulong accepted;
+    atomic_ulong limited;
+    atomic_ulong served;
+    atomic_long active;
+    atomic_ullong busy;
+} listener_t;
+
+int          listener_init(void);
+int          listener_open(void);
+int          listener_count(void);
+listener_t  *listener_get(int index);
+int          listener_accept(listener_t* listener, struct sockaddr_storage* addr, socklen_t* len);
+void         listener_refuse(listener_t* listener, int limited);
+void         listener_done(listener_t* listener, uint64_t elapsed);
+void         listener_close(void);
+
+#endif
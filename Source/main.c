@@ -1,15 +1,19 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
 #include <errno.h>
+#include <stdatomic.h>
 #include <pwd.h>
 #include <grp.h>
 
@@ -18,34 +22,50 @@
 #include "files.h"
 #include "response.h"
 #include "mime.h"
+#include "request.h"
+#include "route.h"
+#include "builder.h"
 #include "errors.h"
+#include "fiber.h"
+#include "trace.h"
+#include "ratelimit.h"
+#include "stream.h"
+#include "uri.h"
+#include "capture.h"
+#include "listener.h"
+#include "cache.h"
 
 struct server_t {
-    int sockfd, newsockfd;
+    int newsockfd;
     socklen_t client_len;
-    struct sockaddr_in server_addr, client_addr;
+    struct sockaddr_storage client_addr;
     threadpool_t *workers;
     gid_t gid;
     uid_t uid;
 };
 
-//global array for supported file mimetypes of server
-mime_t files[] = {
-    {"txt", "text/plain"},
-    {"htm", "text/html"},
-    {"html", "text/html"},
-    {"jpg", "image/jpg"},
-    {"jpeg", "image/jpeg"},
-    {"png", "image/png"},
-    {"ico", "image/ico"},
-    {"gif", "image/gif"},
-    {"pdf", "application/pdf"},
-    {"js", "application/javascript"},
-    {0, 0}};
+//accepted client connection handed to a worker
+struct conn_t {
+    int client;
+    struct sockaddr_storage addr;
+    listener_t *listener;
+    uint32_t trace;
+    uint64_t accepted;
+    threadpool_t *workers;
+    int file;
+    off_t size;
+    const mime_t *mime;
+};
 
 char path[BUFFER];
 
 static int volatile running = 1;
+static int volatile dump = 0;
+
+//server statistics reported by the status route
+static uint64_t started = 0;
+static atomic_ulong served = 0;
+static atomic_int active = 0;
 
 void quit_handler(int derp) {
     //quit signal received, set running flag to 0
@@ -53,12 +73,79 @@ void quit_handler(int derp) {
     running = 0;
 }
 
+void dump_handler(int derp) {
+    //dump signal received, write trace from main loop
+    dump = 1;
+}
+
+//accepts pending clients of listener and schedules them on workers,
+//taking at most LISTEN_BATCH so busy listeners cannot starve others
+static void dispatch(server_t *server, listener_t *listener) {
+    for (int batch = 0; batch < LISTEN_BATCH; batch++) {
+        server->newsockfd = listener_accept(listener, &server->client_addr, &server->client_len);
+        if (server->newsockfd < 0)
+            return;
+
+        //refuse clients over their rate limit before using a worker
+        if (!ratelimit_allow((struct sockaddr *)&server->client_addr, server->client_len)) {
+            if (ratelimit_reject())
+                send(server->newsockfd, too_many, strlen(too_many), MSG_DONTWAIT | MSG_NOSIGNAL);
+            close(server->newsockfd);
+            listener_refuse(listener, 1);
+            continue;
+        }
+
+        //allocate connection for worker
+        conn_t *conn = (conn_t *)malloc(sizeof(conn_t));
+        if (conn == NULL) {
+            exception("Failed to allocate memory for connection");
+            close(server->newsockfd);
+            listener_refuse(listener, 0);
+            continue;
+        }
+
+        uint32_t id = trace_sample();
+        uint64_t accepted = trace_now();
+        conn->client = server->newsockfd;
+        conn->addr = server->client_addr;
+        conn->listener = listener;
+        conn->trace = id;
+        conn->accepted = accepted;
+        conn->workers = server->workers;
+        conn->file = -1;
+
+        //schedule connection request to be handled
+        if (threadpool_schedule(server->workers, &connection, conn, LANE_INTERACTIVE) < 0) {
+            exception("Failed to schedule connection");
+            close(conn->client);
+            free(conn);
+            listener_refuse(listener, 0);
+            continue;
+        }
+        trace_span(id, TRACE_ACCEPT, accepted, trace_now());
+    }
+}
+
 int main() {
     //allocate memory for server
     server_t *server = (server_t *)malloc(sizeof(server_t));
     if (server == NULL)
         error("Failed to allocate memory for server");
 
+    //configure request tracing and rate limiting
+    trace_init();
+    ratelimit_init();
+    stream_init();
+    cache_init();
+
+    //open capture file before changing root
+    if (capture_init() < 0)
+        error("Failed to open capture file, terminating");
+
+    //parse endpoints to listen on
+    if (listener_init() < 0)
+        error("Failed to configure listeners, terminating");
+
     //setup server environment
     printf("Setuping up server environment\n");
     if (setup_env(server) < 0)
@@ -74,12 +161,16 @@ int main() {
         error("Failed to drop privileges, terminating");
 
     printf("Server start successful!\n");
-    printf("Server running on PATH: \"%s\" PORT: %i (CTRL+C to close)\n", path, PORT);
+    printf("Server running on PATH: \"%s\" (CTRL+C to close)\n", path);
 
-    //listen for clients
+    //listen for clients on every endpoint
     printf("Listening for clients\n");
-    listen(server->sockfd, 5);
-    server->client_len = sizeof(struct sockaddr_in);
+    struct pollfd fds[LISTENERS];
+    int listeners = listener_count();
+    for (int i = 0; i < listeners; i++) {
+        fds[i].fd = listener_get(i)->fd;
+        fds[i].events = POLLIN;
+    }
 
     //initialize quit handler
     struct sigaction quit;
@@ -88,11 +179,30 @@ int main() {
     sigemptyset(&quit.sa_mask);
     sigaction(SIGINT, &quit, NULL);
 
+    //initialize trace dump handler
+    struct sigaction trace;
+    trace.sa_handler = dump_handler;
+    trace.sa_flags = 0;
+    sigemptyset(&trace.sa_mask);
+    sigaction(SIGUSR1, &trace, NULL);
+
     //main server loop
     while (running) {
-        //schedule connection request to be handled
-        server->newsockfd = accept(server->sockfd, (struct sockaddr *)&server->client_addr, &server->client_len);
-        threadpool_schedule(server->workers, &connection, &server->newsockfd);
+        //wait for clients, interrupted by a signal
+        int ready = poll(fds, listeners, -1);
+        if (dump) {
+            dump = 0;
+            printf("Dumping trace to \"%s\"\n", TRACE_DUMP);
+            if (trace_dump_file(TRACE_DUMP) < 0)
+                exception("Failed to dump trace");
+        }
+
+        if (ready <= 0)
+            continue;
+
+        for (int i = 0; i < listeners; i++)
+            if (fds[i].revents & POLLIN)
+                dispatch(server, listener_get(i));
     }
 
     destroy(server);
@@ -101,48 +211,38 @@ int main() {
 }
 
 int init(server_t *server) {
-    //open streamsocket over INET
-    //note that steamsockets use TCP protocol
-    printf("--opening socket\n");
-    server->sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server->sockfd < 0) {
-        exception("Error opening socket");
+    //bind and listen on every configured endpoint
+    printf("--opening listeners\n");
+    if (listener_open() < 0) {
+        exception("Failed to open listeners");
         destroy(server);
         return -1;
     }
 
-    //configure server socket for immediate reuse after server termination
-    printf("--configuring socket\n");
-    int enable = 1;
-    if (setsockopt(server->sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
-        exception("Failed to setup socket");
+    //register dynamic request handlers
+    printf("--registering routes\n");
+    if (routes() < 0) {
+        exception("Failed to register routes");
         destroy(server);
-        return -2;
-    }
-
-    //initialize server addr_in
-    memset((char *)&server->server_addr, '\0', sizeof(struct sockaddr_in));
-    server->server_addr.sin_family = AF_INET;
-    server->server_addr.sin_addr.s_addr = INADDR_ANY;
-    server->server_addr.sin_port = htons(PORT);
-
-    //attempt to bind to PORT
-    printf("--attempting to bind to port: %i\n", PORT);
-    if (bind(server->sockfd, (struct sockaddr *)&server->server_addr, sizeof(struct sockaddr_in)) < 0) {
-        exception("Failed to bind port");
-        destroy(server);
-        return -3;
+        return -5;
     }
 
     //create threadpool
     printf("--creating worker threads\n");
-    server->workers = threadpool_create(8, 32);
+    server->workers = threadpool_create(WORKERS, 32);
     if (server->workers == NULL) {
         exception("Failed to create threadpool");
         destroy(server);
         return -4;
     }
 
+    //keep workers free for small requests while large files are sent
+    if (threadpool_lanes(server->workers, RESERVED_WORKERS, BULK_WEIGHT) < 0) {
+        exception("Failed to configure threadpool lanes");
+        destroy(server);
+        return -6;
+    }
+
     return 0;
 }
 
@@ -247,130 +347,308 @@ int drop_privileges(server_t *server) {
 
 //handles incoming connections
 void connection(void *arg) {
-    char req[BUFFER], res[BUFFER], tmp[BUFFER];
-    char *ptr;
-    int file, len;
+    conn_t *conn = (conn_t *)arg;
+    uint64_t queued, dequeued;
 
-    //Initialize file descriptor for client
-    int client = *((int *)arg);
+    //record time spent waiting in the task queue
+    threadpool_task_times(&queued, &dequeued);
+    trace_span(conn->trace, TRACE_QUEUE, queued, dequeued);
+
+    atomic_fetch_add(&active, 1);
+    if (handle(conn) == 0)
+        finish(conn);
+}
+
+//sends a bulk file handed over by connection from the bulk lane
+void transfer(void *arg) {
+    conn_t *conn = (conn_t *)arg;
+    uint64_t queued, dequeued;
+
+    //record time spent waiting in the bulk lane
+    threadpool_task_times(&queued, &dequeued);
+    trace_span(conn->trace, TRACE_QUEUE, queued, dequeued);
 
-    //check if connection was successful
-    if (client < 0) {
-        exception("Failed to establish connection with client");
-        return;
+    send_file(conn);
+    finish(conn);
+}
+
+//cleans up connection with client once its request is done
+void finish(conn_t *conn) {
+    atomic_fetch_sub(&active, 1);
+    atomic_fetch_add(&served, 1);
+
+    shutdown(conn->client, SHUT_RDWR);
+    close(conn->client);
+
+    uint64_t now = trace_now();
+    listener_done(conn->listener, now - conn->accepted);
+    trace_span(conn->trace, TRACE_REQUEST, conn->accepted, now);
+    free(conn);
+}
+
+//returns the lane a file of the given type and size should be sent from
+static int classify(const mime_t *mime, off_t size) {
+    if (size > BULK_SIZE || (mime->bulk && size > BULK_MIME_SIZE))
+        return LANE_BULK;
+    return LANE_INTERACTIVE;
+}
+
+//reports that the server is up
+int health_route(int method, const char *target, builder_t *res) {
+    builder_header(res, "Content-Type", "text/plain");
+    return builder_body(res, "OK\n", 3);
+}
+
+//reports server statistics as JSON
+int status_route(int method, const char *target, builder_t *res) {
+    builder_header(res, "Content-Type", "application/json");
+    builder_printf(res, "{\"uptime\":%.3f,\"served\":%lu,\"active\":%i,\"rate_limited\":%llu,",
+        (trace_now() - started) / 1e9, atomic_load(&served), atomic_load(&active),
+        (unsigned long long)ratelimit_rejected());
+
+    //memory used by cached files and how many requests they served
+    cache_stats_t cache;
+    cache_stats(&cache);
+    builder_printf(res, "\"cache\":{\"hits\":%llu,\"misses\":%llu,\"hit_ratio\":%.4f,\"entries\":%llu,"
+        "\"bytes\":%llu,\"budget\":%llu,\"admitted\":%llu,\"rejected\":%llu,\"evicted\":%llu,"
+        "\"zerocopy\":%llu,\"zerocopy_copied\":%llu},",
+        (unsigned long long)cache.hits, (unsigned long long)cache.misses,
+        cache.hits + cache.misses > 0 ? (double)cache.hits / (cache.hits + cache.misses) : 0.0,
+        (unsigned long long)cache.entries, (unsigned long long)cache.bytes, (unsigned long long)cache.budget,
+        (unsigned long long)cache.admitted, (unsigned long long)cache.rejected, (unsigned long long)cache.evicted,
+        (unsigned long long)cache.zerocopy, (unsigned long long)cache.copied);
+
+    //per endpoint counters, busy is the mean time connections were open
+    builder_printf(res, "\"listeners\":[");
+    for (int i = 0; i < listener_count(); i++) {
+        listener_t *listener = listener_get(i);
+        unsigned long done = atomic_load(&listener->served);
+        builder_printf(res, "%s{\"name\":\"%s\",\"accepted\":%lu,\"rate_limited\":%lu,\"served\":%lu,"
+            "\"active\":%li,\"mean_us\":%.1f}", i > 0 ? "," : "", listener->name,
+            atomic_load(&listener->accepted), atomic_load(&listener->limited), done,
+            atomic_load(&listener->active), done > 0 ? atomic_load(&listener->busy) / 1e3 / done : 0.0);
     }
-    else
-        printf("Connection established with client\n");
+
+    return builder_printf(res, "]}\n");
+}
+
+//writes chunk of a trace dump to a streamed response
+static int builder_sink(void *ctx, const char *buf, size_t len) {
+    return builder_chunk((builder_t *)ctx, buf, len);
+}
+
+//streams spans recorded so far as Chrome trace JSON
+int trace_route(int method, const char *target, builder_t *res) {
+    builder_header(res, "Content-Type", "application/json");
+    return trace_dump(builder_sink, res);
+}
+
+//registers the server's dynamic request handlers
+//returns 0 if successful, else returns a negative value
+int routes(void) {
+    started = trace_now();
+
+    if (route_register(REQ_GET, "/health", health_route) < 0)
+        return -1;
+    if (route_register(REQ_GET, "/status", status_route) < 0)
+        return -2;
+    if (route_register(REQ_GET, TRACE_ENDPOINT, trace_route) < 0)
+        return -3;
+
+    return route_compile();
+}
+
+//handles the request of a connected client
+//returns 1 if the connection was handed to another task, else returns 0
+int handle(conn_t *conn) {
+    char req[BUFFER], res[BUFFER];
+    char *ptr;
+    int file, len, method;
+    route_fn fn;
+    uint64_t stamp = trace_now();
+
+    //Initialize file descriptor for client
+    int client = conn->client;
+    printf("Connection established with client\n");
 
     //initialize buffers
     memset(req, '\0', sizeof(req));
     memset(res, '\0', sizeof(res));
-    memset(tmp, '\0', sizeof(tmp));
 
     //read request from client
-    len = read(client, req, sizeof(req) - 1);
+    len = fiber_read(client, req, sizeof(req) - 1);
     if (len < 0) {
         exception("Failed  to read from socket");
-        return;
+        return 0;
     }
     else {
         printf("Request from client: ");
         printf("%s\n", req);
     }
 
+    //record request for replay before parsing modifies it
+    capture_request(conn->accepted, req, len);
+
     //handle request
-    ptr = strstr(req, " HTTP/");
-    if (ptr == NULL)
+    method = parse_request(req, &ptr);
+    trace_span(conn->trace, TRACE_PARSE, stamp, trace_now());
+
+    if (method == REQ_INVALID) {
         printf("Not an HTTP request\n");
+        return 0;
+    }
+
+    //unknown method or missing target
+    if (method == REQ_BAD || ptr == NULL) {
+        printf("400 Bad Request\n");
+        response(client, bad_req);
+        return 0;
+    }
+
+    //decode target into a canonical path for routing and opening files
+    len = uri_canonicalize(ptr, res, sizeof(res));
+    if (len == URI_TRAVERSAL) {
+        printf("403 Forbidden Access\n");
+        response(client, forbidden);
+        return 0;
+    }
+    if (len < 0) {
+        printf("400 Bad Request\n");
+        response(client, bad_req);
+        return 0;
+    }
+
+    //HEAD falls back to the GET handler, sending only its headers
+    int head_only = 0;
+    if ((fn = route_lookup(method, res)) == NULL && method == REQ_HEAD)
+        head_only = (fn = route_lookup(REQ_GET, res)) != NULL;
+
+    if (fn != NULL) {
+        //dispatch to dynamic handler registered for target
+        builder_t out;
+        builder_init(&out, client);
+        out.head_only = head_only;
+        printf("Dispatching \"%s\" to handler\n", res);
+        if (fn(method, ptr, &out) < 0 || builder_end(&out) < 0) {
+            exception("Failed to handle request");
+            if (!out.sent)
+                response(client, server_error);
+        }
+    }
+    else if (method != REQ_GET && method != REQ_HEAD) {
+        printf("501 Method Not Implemented\n");
+        response(client, bad_method);
+    }
     else {
-        *ptr = 0;
-        ptr = NULL;
-
-        //get the request type, currently only handling HTTP GET
-        if (strncmp(req, "GET ", 4) == 0)
-            ptr = req + 4;
-
-        if (ptr == NULL)
-            response(client, bad_req);
-        else {
-            if (ptr[strlen(ptr) - 1] == '/')
-                strcat(ptr, "index.html");
-
-            //setup path for opening files
-            strcat(res, ptr);
-            char *s = strchr(ptr, '.');
-
-            //check all supported mimtypes to determine if
-            //requested file is supported
-            int cur = 0;
-            while (files[cur].extension != 0) {
-                //if mimetype supported
-                if (strcmp(s + 1, files[cur].extension) == 0) {
-                    //open file
-                    file = open(res, O_RDONLY, 0);
-                    printf("Opening \"%s\"\n", res);
-
-                    //handle errors while accessing file
-                    if (file < 0) {
-                        //file does not exist
-                        if (errno == ENOENT) {
-                            printf("404 File not found\n");
-                            response(client, not_found);
-                        }
-
-                        //access denied due to lack of read permissions
-                        if (errno == EACCES) {
-                            printf("403 Forbidden Access\n");
-                            response(client, forbidden);
-                        }
-                    }
-                    else {
-                        //check if owner of file, nandle if not
-                        if (getuid() != get_fuid(file)) {
-                            printf("403 Forbidden Access\n");
-                            response(client, forbidden);
-                            return;
-                        }
-
-                        //send response header to client
-                        memset(tmp, '\0', sizeof(tmp));
-                        printf("200 OK, Content-Type: %s\n", files[cur].type);
-                        response(client, ok);
-                        sprintf(tmp, "Content-Type: %s\n", files[cur].type);
-                        response(client, tmp);
-                        sprintf(tmp, "Content-Length: %i\n\n", (int)get_fsize(file));
-                        response(client, tmp);
-
-                        //send response data to client
-                        if (ptr == req + 4) {
-                            //handle error during send
-                            if (fresponse(client, file) < 0) {
-                                exception("Failed to send file to client");
-                                return;
-                            }
-                        }
-                    }
-
-                    // done handling request 
-                    break;
-                }
-                //handled Unsupported mimetype
-                if (cur == (sizeof(files) / sizeof(files[0]) - 2)) {
-                    printf("415 Unsupported Media Type\n");
-                    response(client, unsupported_media);
-                }
-
-                //increment current file.
-                cur++;
+        //serve hot files straight from memory
+        stamp = trace_now();
+        int cached = method == REQ_GET ? cache_send(client, res) : 1;
+        if (cached <= 0) {
+            if (cached < 0)
+                exception("Failed to send cached file to client");
+            trace_span(conn->trace, TRACE_CACHE, stamp, trace_now());
+            return 0;
+        }
+
+        //check if requested file has a supported mimetype
+        const mime_t *mime = mime_lookup(res);
+        if (mime == NULL) {
+            printf("415 Unsupported Media Type\n");
+            response(client, unsupported_media);
+            return 0;
+        }
+
+        //open file
+        stamp = trace_now();
+        file = open(res, O_RDONLY, 0);
+        printf("Opening \"%s\"\n", res);
+
+        //handle errors while accessing file
+        if (file < 0) {
+            //file does not exist
+            if (errno == ENOENT) {
+                printf("404 File not found\n");
+                response(client, not_found);
             }
+
+            //access denied due to lack of read permissions
+            if (errno == EACCES) {
+                printf("403 Forbidden Access\n");
+                response(client, forbidden);
+            }
+            return 0;
+        }
+
+        //check if owner of file, nandle if not
+        if (getuid() != get_fuid(file)) {
+            printf("403 Forbidden Access\n");
+            response(client, forbidden);
+            close(file);
+            return 0;
+        }
+        conn->file = file;
+        conn->mime = mime;
+        conn->size = get_fsize(file);
+        trace_span(conn->trace, TRACE_OPEN, stamp, trace_now());
+
+        //answer HEAD with the header a GET would get
+        if (method == REQ_HEAD) {
+            char tmp[BUFFER];
+            if (render_header(tmp, sizeof(tmp), mime->type, conn->size) < 0 || response(client, tmp) < 0)
+                exception("Failed to send header to client");
+            close(file);
+            return 0;
+        }
+
+        //hand large transfers to the bulk lane, freeing this worker
+        int lane = classify(mime, conn->size);
+        if (lane == LANE_BULK) {
+            if (threadpool_schedule(conn->workers, &transfer, conn, LANE_BULK) == 0)
+                return 1;
         }
+
+        //keep small files that are requested often in memory
+        stamp = trace_now();
+        if (lane == LANE_INTERACTIVE && (cached = cache_insert(client, res, file, mime, conn->size)) <= 0) {
+            if (cached < 0)
+                exception("Failed to send cached file to client");
+            trace_span(conn->trace, TRACE_CACHE, stamp, trace_now());
+            close(file);
+            return 0;
+        }
+
+        send_file(conn);
     }
 
-    //cleanup connection with client
-    close(client);
-    shutdown(client, SHUT_RDWR);
+    return 0;
+}
+
+//sends response header and the opened file of conn to its client
+//returns 0 if successful, else returns a negative value
+int send_file(conn_t *conn) {
+    char tmp[BUFFER];
+    int res = 0;
+
+    //send response header to client
+    uint64_t stamp = trace_now();
+    printf("200 OK, Content-Type: %s\n", conn->mime->type);
+    if (render_header(tmp, sizeof(tmp), conn->mime->type, conn->size) < 0 || response(conn->client, tmp) < 0) {
+        exception("Failed to send header to client");
+        close(conn->file);
+        return -1;
+    }
+    trace_span(conn->trace, TRACE_HEADER, stamp, trace_now());
+
+    //send response data to client
+    stamp = trace_now();
+    if (fresponse(conn->client, conn->file) < 0) {
+        exception("Failed to send file to client");
+        res = -2;
+    }
+    trace_span(conn->trace, TRACE_SENDFILE, stamp, trace_now());
 
-    return;
+    close(conn->file);
+    return res;
 }
 
 //Returns the gid associated with a input username if they exist on system
@@ -391,32 +669,35 @@ uid_t getuid_byName(const char *name) {
 
 //Sends response to client, returns the number of Bytes sent
 //else returns -1
-int response(int client, char *res) {
+int response(int client, const char *res) {
     int len = strlen(res);
     //If write failed, return -1
-    if (write(client, res, len) < 0) return -1;
+    if (fiber_write(client, res, len) < 0) return -1;
     //otherwise, return number of bytes sent
     return (len + 1) * sizeof(char);
 }
 
-//Sends a file to client, returning the number of bytes sent.
-//else returns -1
+//Sends a file to client, large files are streamed fairly
+//returns 0 if successful, else returns a negative value
 int fresponse(int client, int res) {
     //check if file has valid len
-    int len = 0;
-    if ((len = (int)get_fsize(res)) < 0) return -1;
+    off_t len = 0;
+    if ((len = get_fsize(res)) < 0) return -1;
+
+    //stream large files in slices
+    if (len > stream_threshold())
+        return stream_file(client, res, len) < 0 ? -3 : 0;
 
     //keep sending until buffer is empty
-    int total_sent = 0;
-    int sent = 0;
+    off_t total_sent = 0;
+    ssize_t sent = 0;
     while (total_sent < len) {
-        sent = sendfile(client, res, 0, len - total_sent);
+        sent = fiber_sendfile(client, res, &total_sent, len - total_sent);
         //check if failed to send
         if (sent <= 0) return -2;
-        total_sent += sent;
     }
 
-    return get_fsize(res);
+    return 0;
 }
 
 //Receives a request from a client, returns the number of
@@ -430,9 +711,17 @@ void destroy(server_t *server) {
     //signal threadpool workers to stop accepting connections, then destroy threads
     if (server->workers != NULL) threadpool_destroy(server->workers);
 
+    //free dynamic request handlers
+    route_destroy();
+
+    //flush captured requests
+    capture_close();
+
+    //free cached files
+    cache_destroy();
+
     //close server sockets
-    close(server->sockfd);
-    shutdown(server->sockfd, SHUT_RDWR);
+    listener_close();
     shutdown(server->newsockfd, SHUT_RDWR);
 
     //destruct server
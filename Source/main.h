@@ -1,23 +1,36 @@
 #ifndef MAIN_H
 #define MAIN_H
 
+#include <sys/types.h>
+
 #define PORT          80
 #define PATH          getenv("PWD")
 #define WEBROOT       "/Web"
 #define BUFFER        1024
 #define MAX_THREADS   64
 #define MAX_TASKS     65536
+#define WORKERS       8
+#define RESERVED_WORKERS  2                 //workers kept for interactive requests
+#define BULK_WEIGHT       4                 //interactive requests taken per bulk transfer
+#define BULK_SIZE         (1024 * 1024)     //files above this are bulk transfers
+#define BULK_MIME_SIZE    (64 * 1024)       //bulk mimetypes above this are bulk transfers
 
 typedef struct server_t server_t;
+typedef struct conn_t conn_t;
 
 int           init(server_t*);
 int           setup_env(server_t*);
+int           routes(void);
 int           drop_privileges(server_t*);
 void          connection(void* arg);
+int           handle(conn_t*);
+void          transfer(void* arg);
+int           send_file(conn_t*);
+void          finish(conn_t*);
 void          destroy(server_t*);
 uid_t         getuid_byName(const char* name);
 gid_t         getgid_byName(const char* name);
-int           response(int client, char* res);
+int           response(int client, const char* res);
 int           fresponse(int fd, int res);
 int           request(int fd, char* req);
 
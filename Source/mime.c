@@ -0,0 +1,32 @@
+#include <string.h>
+
+#include "mime.h"
+
+//global array for supported file mimetypes of server
+//bulk types are usually downloaded rather than rendered inline
+mime_t files[] = {
+  {"txt", "text/plain", 0},
+  {"htm", "text/html", 0},
+  {"html", "text/html", 0},
+  {"jpg", "image/jpg", 0},
+  {"jpeg", "image/jpeg", 0},
+  {"png", "image/png", 0},
+  {"ico", "image/ico", 0},
+  {"gif", "image/gif", 0},
+  {"pdf", "application/pdf", 1},
+  {"js", "application/javascript", 0},
+  {0, 0, 0}};
+
+//Returns the mimetype matching the extension of path,
+//else returns NULL if the extension is unsupported
+const mime_t* mime_lookup(const char* path) {
+  const char* ext = strrchr(path, '.');
+  if (ext == NULL || strchr(ext, '/') != NULL)
+    return NULL;
+
+  for (int cur = 0; files[cur].extension != 0; cur++)
+    if (strcmp(ext + 1, files[cur].extension) == 0)
+      return &files[cur];
+
+  return NULL;
+}
@@ -4,6 +4,11 @@
 typedef struct {
   const char* extension;
   const char* type;
+  int bulk;
 } mime_t;
 
+extern mime_t files[];
+
+const mime_t* mime_lookup(const char* path);
+
 #endif
@@ -0,0 +1,197 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+
+#include "ratelimit.h"
+#include "trace.h"
+
+//bucket state packs the last refill time in milliseconds into the upper
+//40 bits and the tokens, in 1/16ths, into the lower 24 bits
+#define TOKEN_SCALE   16
+#define TOKEN_BITS    24
+#define TOKEN_MASK    ((1ull << TOKEN_BITS) - 1)
+
+#define KEY_HOST      (1ull << 62)
+#define KEY_PREFIX    (2ull << 62)
+
+//token bucket of one client address or prefix, a key of 0 marks a free slot
+typedef struct bucket_t {
+    atomic_uint_fast64_t key;
+    atomic_uint_fast64_t state;
+} bucket_t;
+
+static bucket_t buckets[RATE_SLOTS];
+static atomic_uint_fast64_t rejected = 0;
+static uint64_t epoch = 0;
+
+static uint64_t limit = RATE_LIMIT;
+static uint64_t burst = RATE_BURST;
+static uint64_t prefix_limit = RATE_PREFIX_LIMIT;
+static uint64_t prefix_burst = RATE_PREFIX_BURST;
+static int reject = RATE_REJECT;
+
+//reads an unsigned setting from the environment, else returns def
+static uint64_t ratelimit_env(const char *name, uint64_t def) {
+    char *env = getenv(name);
+    return env != NULL ? strtoull(env, NULL, 10) : def;
+}
+
+//configures limits, settings of the same name in the environment
+//override the defaults
+void ratelimit_init(void) {
+    limit = ratelimit_env("RATE_LIMIT", RATE_LIMIT);
+    burst = ratelimit_env("RATE_BURST", RATE_BURST);
+    prefix_limit = ratelimit_env("RATE_PREFIX_LIMIT", RATE_PREFIX_LIMIT);
+    prefix_burst = ratelimit_env("RATE_PREFIX_BURST", RATE_PREFIX_BURST);
+    reject = (int)ratelimit_env("RATE_REJECT", RATE_REJECT);
+
+    //buckets must fit their token field
+    if (burst * TOKEN_SCALE > TOKEN_MASK)
+        burst = TOKEN_MASK / TOKEN_SCALE;
+    if (prefix_burst * TOKEN_SCALE > TOKEN_MASK)
+        prefix_burst = TOKEN_MASK / TOKEN_SCALE;
+
+    epoch = trace_now();
+}
+
+//mixes a key into a table index
+static uint64_t ratelimit_hash(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    return key;
+}
+
+//returns the bucket for key, claiming a free slot or evicting the least
+//recently refilled bucket among the probed slots if it has none,
+//else returns NULL if that bucket was just taken for another key
+static bucket_t *ratelimit_bucket(uint64_t key, uint64_t now, uint64_t full) {
+    uint64_t start = ratelimit_hash(key);
+    bucket_t *oldest = NULL;
+    uint64_t oldest_key = 0, oldest_time = UINT64_MAX;
+
+    for (int i = 0; i < RATE_PROBE; i++) {
+        bucket_t *bucket = &buckets[(start + i) & (RATE_SLOTS - 1)];
+        uint64_t cur = atomic_load_explicit(&bucket->key, memory_order_acquire);
+
+        if (cur == key)
+            return bucket;
+
+        //claim free slot, unless another thread just claimed it
+        if (cur == 0) {
+            if (atomic_compare_exchange_strong(&bucket->key, &cur, key)) {
+                atomic_store_explicit(&bucket->state, (now << TOKEN_BITS) | full, memory_order_release);
+                return bucket;
+            }
+            if (cur == key)
+                return bucket;
+        }
+
+        uint64_t time = atomic_load_explicit(&bucket->state, memory_order_relaxed) >> TOKEN_BITS;
+        if (time < oldest_time) {
+            oldest = bucket;
+            oldest_key = cur;
+            oldest_time = time;
+        }
+    }
+
+    //table is crowded here, recycle the stalest bucket
+    if (atomic_compare_exchange_strong(&oldest->key, &oldest_key, key)) {
+        atomic_store_explicit(&oldest->state, (now << TOKEN_BITS) | full, memory_order_release);
+        return oldest;
+    }
+
+    //another thread recycled it first, for this key or a different one
+    return oldest_key == key ? oldest : NULL;
+}
+
+//refills the bucket for key and takes a token from it,
+//returns 1 if a token was available, else returns 0
+static int ratelimit_take(uint64_t key, uint64_t rate, uint64_t size) {
+    uint64_t now = (trace_now() - epoch) / 1000000;
+    uint64_t full = size * TOKEN_SCALE;
+    bucket_t *bucket = ratelimit_bucket(key, now, full);
+
+    //lost a race for a recycled slot, let this request through rather
+    //than charging another client's bucket
+    if (bucket == NULL)
+        return 1;
+
+    uint64_t old = atomic_load_explicit(&bucket->state, memory_order_relaxed);
+    while (1) {
+        uint64_t last = old >> TOKEN_BITS;
+        uint64_t tokens = old & TOKEN_MASK;
+
+        //move refill time forward only by the time whole units were
+        //credited for, so fractions of a unit carry over to the next check
+        uint64_t per = rate * TOKEN_SCALE;
+        uint64_t refill = now > last ? (now - last) * per / 1000 : 0;
+        if (refill > 0) {
+            tokens = tokens + refill > full ? full : tokens + refill;
+            last += (refill * 1000 + per - 1) / per;
+        }
+
+        int allowed = tokens >= TOKEN_SCALE;
+        if (allowed)
+            tokens -= TOKEN_SCALE;
+
+        uint64_t state = (last << TOKEN_BITS) | tokens;
+        if (state == old || atomic_compare_exchange_weak(&bucket->state, &old, state))
+            return allowed;
+    }
+}
+
+//Checks whether the client at addr may make another request, charging its
+//address and prefix buckets. Returns 1 if allowed, else returns 0
+int ratelimit_allow(const struct sockaddr *addr, socklen_t len) {
+    uint64_t host, prefix;
+
+    if (limit == 0 && prefix_limit == 0)
+        return 1;
+
+    //keys are the address and its /24, or a hash of it and its /64.
+    //IPv4 clients of dual stack listeners arrive as mapped addresses
+    const struct sockaddr_in6 *addr6 = (const struct sockaddr_in6 *)addr;
+    int v6 = addr->sa_family == AF_INET6 && len >= sizeof(struct sockaddr_in6);
+    if ((addr->sa_family == AF_INET && len >= sizeof(struct sockaddr_in)) ||
+        (v6 && IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr))) {
+        uint32_t ip;
+        if (v6)
+            memcpy(&ip, addr6->sin6_addr.s6_addr + 12, sizeof(ip));
+        else
+            ip = ((const struct sockaddr_in *)addr)->sin_addr.s_addr;
+        ip = ntohl(ip);
+        host = KEY_HOST | ip;
+        prefix = KEY_PREFIX | (ip & 0xffffff00u);
+    }
+    else if (v6) {
+        uint64_t hi, lo;
+        const unsigned char *ip = addr6->sin6_addr.s6_addr;
+        memcpy(&hi, ip, sizeof(hi));
+        memcpy(&lo, ip + 8, sizeof(lo));
+        host = KEY_HOST | ((ratelimit_hash(hi) ^ lo) & ~(3ull << 62));
+        prefix = KEY_PREFIX | (ratelimit_hash(hi) & ~(3ull << 62));
+    }
+    else
+        return 1;
+
+    //charge the prefix only for hosts within their own limit, so one
+    //aggressive client cannot use up its neighbours' tokens
+    int allowed = 1;
+    if (limit > 0 && !ratelimit_take(host, limit, burst))
+        allowed = 0;
+    if (allowed && prefix_limit > 0 && !ratelimit_take(prefix, prefix_limit, prefix_burst))
+        allowed = 0;
+
+    if (!allowed)
+        atomic_fetch_add_explicit(&rejected, 1, memory_order_relaxed);
+
+    return allowed;
+}
+
+//returns 1 if limited clients should be answered with 429, else returns 0
+int ratelimit_reject(void) { return reject; }
+
+//returns the number of connections refused so far
+uint64_t ratelimit_rejected(void) { return atomic_load_explicit(&rejected, memory_order_relaxed); }
@@ -0,0 +1,20 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define RATE_LIMIT          0       //requests per second per client address, 0 disables limiting
+#define RATE_BURST          64      //requests a client address may make at once
+#define RATE_PREFIX_LIMIT   0       //requests per second per /24 or /64 prefix, 0 disables
+#define RATE_PREFIX_BURST   256     //requests a prefix may make at once
+#define RATE_REJECT         1       //answer limited clients with 429, else just close
+#define RATE_SLOTS          4096    //token buckets in the table, a power of two
+#define RATE_PROBE          8       //slots probed before evicting the least recently used
+
+void      ratelimit_init(void);
+int       ratelimit_allow(const struct sockaddr* addr, socklen_t len);
+int       ratelimit_reject(void);
+uint64_t  ratelimit_rejected(void);
+
+#endif
@@ -0,0 +1,28 @@
+#include <string.h>
+
+#include "request.h"
+
+//request methods understood by the server, indexed by REQ_ value
+static const char* methods[REQ_METHODS] = {"GET", "HEAD", "POST", "PUT", "DELETE"};
+
+//Parses the request line in req, terminating it in place and pointing
+//target at the requested path. Returns the request method, REQ_BAD for
+//unhandled methods or empty targets, or REQ_INVALID if req is not HTTP
+int parse_request(char* req, char** target) {
+  char* ptr = strstr(req, " HTTP/");
+  *target = NULL;
+  if (ptr == NULL)
+    return REQ_INVALID;
+  *ptr = 0;
+
+  //match method followed by a single space and a non empty target
+  for (int method = 0; method < REQ_METHODS; method++) {
+    size_t len = strlen(methods[method]);
+    if (strncmp(req, methods[method], len) == 0 && req[len] == ' ' && req[len + 1] != 0) {
+      *target = req + len + 1;
+      return method;
+    }
+  }
+
+  return REQ_BAD;
+}
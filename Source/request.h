@@ -0,0 +1,15 @@
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#define REQ_INVALID   -1
+#define REQ_GET        0
+#define REQ_HEAD       1
+#define REQ_POST       2
+#define REQ_PUT        3
+#define REQ_DELETE     4
+#define REQ_BAD        5
+#define REQ_METHODS    5
+
+int parse_request(char* req, char** target);
+
+#endif
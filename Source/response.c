@@ -1,6 +1,10 @@
 //This file contains common HTTP response headers
 //and HTML pages. Specifically those for success and error codes.
 
+#include <stdio.h>
+
+#include "response.h"
+
 const char* ok =
   "HTTP/1.1 200 OK\n";
 
@@ -58,3 +62,31 @@ const char* forbidden =
   "   <p>You don't have permission to access x on this server.</p>\n"
   " </body>\n"
   "</html>\n";
+
+const char* server_error =
+  "HTTP/1.1 500 Internal Server Error\n"
+  "Content-type: text/html\n"
+  "\n"
+  "<html>\n"
+  " <body>\n"
+  "   <h1>Internal Server Error</h1>\n"
+  "   <p>The server failed to handle your request.</p>\n"
+  " </body>\n"
+  "</html>\n";
+
+const char* too_many =
+  "HTTP/1.1 429 Too Many Requests\n"
+  "Content-type: text/plain\n"
+  "Retry-After: 1\n"
+  "\n"
+  "Too many requests\n";
+
+//Renders a 200 OK response header for content of type and len into buf,
+//returns the length of the header, else returns -1 if buf is too small
+int render_header(char* buf, size_t size, const char* type, off_t len) {
+  int res = snprintf(buf, size, "%sContent-Type: %s\nContent-Length: %lld\n\n",
+    ok, type, (long long)len);
+  if (res < 0 || (size_t)res >= size)
+    return -1;
+  return res;
+}
@@ -1,11 +1,18 @@
 #ifndef RESPONSE_H
 #define RESPONSE_H
 
-extern char* ok;
-extern char* bad_req;
-extern char* not_found;
-extern char* bad_method;
-extern char* unsupported_media;
-extern char* forbidden;
+#include <stddef.h>
+#include <sys/types.h>
+
+extern const char* ok;
+extern const char* bad_req;
+extern const char* not_found;
+extern const char* bad_method;
+extern const char* unsupported_media;
+extern const char* forbidden;
+extern const char* server_error;
+extern const char* too_many;
+
+int render_header(char* buf, size_t size, const char* type, off_t len);
 
 #endif
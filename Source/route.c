@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "route.h"
+
+//node of the radix tree built while registering routes
+typedef struct rnode_t {
+    char *label;
+    size_t len;
+    route_fn fn[REQ_METHODS];
+    struct rnode_t **children;
+    int num;
+} rnode_t;
+
+//node of the compiled tree, children of a node are stored contiguously
+//and sorted by the first byte of their label
+typedef struct cnode_t {
+    uint32_t label;
+    uint32_t len;
+    uint32_t first;
+    uint16_t num;
+    unsigned char lead;
+    route_fn fn[REQ_METHODS];
+} cnode_t;
+
+static rnode_t *root = NULL;
+static int nodes = 0;
+static size_t label_bytes = 0;
+
+static cnode_t *table = NULL;
+static char *labels = NULL;
+
+//allocates a tree node labelled with the first len bytes of label
+static rnode_t *route_node(const char *label, size_t len) {
+    rnode_t *node = (rnode_t *)calloc(1, sizeof(rnode_t));
+    if (node == NULL)
+        return NULL;
+
+    node->label = (char *)malloc(len + 1);
+    if (node->label == NULL) {
+        free(node);
+        return NULL;
+    }
+    memcpy(node->label, label, len);
+    node->label[len] = 0;
+    node->len = len;
+
+    nodes++;
+    label_bytes += len;
+    return node;
+}
+
+//appends child to node, returns 0 if successful, else returns -1
+static int route_adopt(rnode_t *node, rnode_t *child) {
+    rnode_t **children = (rnode_t **)realloc(node->children, (node->num + 1) * sizeof(rnode_t *));
+    if (children == NULL)
+        return -1;
+
+    node->children = children;
+    node->children[node->num++] = child;
+    return 0;
+}
+
+//Registers fn for requests of method whose target is prefix or a path
+//below it, e.g. "/status" matches "/status/x" but not "/status.html".
+//Longer prefixes take precedence. Routes must be registered and compiled
+//before requests are served. Returns 0 if successful, else returns a
+//negative value
+int route_register(int method, const char *prefix, route_fn fn) {
+    if (method != ROUTE_ANY && (method < 0 || method >= REQ_METHODS))
+        return -1;
+
+    if (root == NULL && (root = route_node("", 0)) == NULL)
+        return -2;
+
+    rnode_t *node = root;
+    while (*prefix) {
+        //find child sharing the first byte of the remaining prefix
+        rnode_t *child = NULL;
+        int cur;
+        for (cur = 0; cur < node->num; cur++) {
+            if (node->children[cur]->label[0] == *prefix) {
+                child = node->children[cur];
+                break;
+            }
+        }
+
+        //no child shares it, add remaining prefix as a leaf
+        if (child == NULL) {
+            child = route_node(prefix, strlen(prefix));
+            if (child == NULL || route_adopt(node, child) < 0)
+                return -2;
+            node = child;
+            break;
+        }
+
+        size_t common = 0;
+        while (common < child->len && prefix[common] == child->label[common])
+            common++;
+
+        //split child where the prefix diverges from its label
+        if (common < child->len) {
+            rnode_t *mid = route_node(child->label, common);
+            if (mid == NULL || route_adopt(mid, child) < 0)
+                return -2;
+
+            memmove(child->label, child->label + common, child->len - common + 1);
+            child->len -= common;
+            label_bytes -= common;
+            node->children[cur] = mid;
+            child = mid;
+        }
+
+        node = child;
+        prefix += common;
+    }
+
+    for (int cur = 0; cur < REQ_METHODS; cur++)
+        if (method == ROUTE_ANY || method == cur)
+            node->fn[cur] = fn;
+
+    return 0;
+}
+
+static int route_compare(const void *a, const void *b) {
+    const rnode_t *x = *(rnode_t *const *)a, *y = *(rnode_t *const *)b;
+    return (unsigned char)x->label[0] - (unsigned char)y->label[0];
+}
+
+//Flattens the registered routes into a compact breadth first table,
+//returns 0 if successful, else returns a negative value
+int route_compile(void) {
+    if (root == NULL)
+        return 0;
+
+    cnode_t *compiled = (cnode_t *)calloc(nodes, sizeof(cnode_t));
+    char *text = (char *)malloc(label_bytes + 1);
+    rnode_t **queue = (rnode_t **)malloc(nodes * sizeof(rnode_t *));
+    if (compiled == NULL || text == NULL || queue == NULL) {
+        free(compiled);
+        free(text);
+        free(queue);
+        return -1;
+    }
+
+    //each node's children are queued together, so they end up adjacent
+    int head = 0, tail = 0;
+    size_t used = 0;
+    queue[tail++] = root;
+    while (head < tail) {
+        rnode_t *node = queue[head];
+        cnode_t *out = &compiled[head];
+        head++;
+
+        qsort(node->children, node->num, sizeof(rnode_t *), route_compare);
+
+        memcpy(text + used, node->label, node->len);
+        out->label = used;
+        out->len = node->len;
+        out->lead = (unsigned char)node->label[0];
+        out->first = tail;
+        out->num = node->num;
+        memcpy(out->fn, node->fn, sizeof(out->fn));
+        used += node->len;
+
+        for (int cur = 0; cur < node->num; cur++)
+            queue[tail++] = node->children[cur];
+    }
+
+    free(queue);
+    free(table);
+    free(labels);
+    table = compiled;
+    labels = text;
+
+    return 0;
+}
+
+//Returns the handler registered under the longest prefix of target that
+//ends at a path segment boundary for method, else returns NULL
+route_fn route_lookup(int method, const char *target) {
+    if (table == NULL || method < 0 || method >= REQ_METHODS)
+        return NULL;
+
+    route_fn best = NULL;
+    const cnode_t *node = &table[0];
+    while (1) {
+        if (strncmp(target, labels + node->label, node->len) != 0)
+            break;
+        target += node->len;
+
+        //prefixes only match whole path segments
+        if (node->fn[method] != NULL && (*target == 0 || *target == '/' || target[-1] == '/'))
+            best = node->fn[method];
+
+        //binary search children for the next byte of target
+        unsigned char key = (unsigned char)*target;
+        if (key == 0 || node->num == 0)
+            break;
+
+        const cnode_t *next = NULL;
+        int low = node->first, high = node->first + node->num - 1;
+        while (low <= high) {
+            int mid = (low + high) / 2;
+            if (table[mid].lead == key) {
+                next = &table[mid];
+                break;
+            }
+            if (table[mid].lead < key)
+                low = mid + 1;
+            else
+                high = mid - 1;
+        }
+
+        if (next == NULL)
+            break;
+        node = next;
+    }
+
+    return best;
+}
+
+//frees a registration tree node and its descendants
+static void route_free(rnode_t *node) {
+    for (int cur = 0; cur < node->num; cur++)
+        route_free(node->children[cur]);
+    free(node->children);
+    free(node->label);
+    free(node);
+}
+
+//Frees all registered routes
+void route_destroy(void) {
+    if (root != NULL)
+        route_free(root);
+    free(table);
+    free(labels);
+
+    root = NULL;
+    table = NULL;
+    labels = NULL;
+    nodes = 0;
+    label_bytes = 0;
+}
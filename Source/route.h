@@ -0,0 +1,17 @@
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include "builder.h"
+#include "request.h"
+
+#define ROUTE_ANY   -1    //registers a handler for every method
+
+//native request handler, returns negative if the request failed
+typedef int (*route_fn)(int method, const char* target, builder_t* res);
+
+int       route_register(int method, const char* prefix, route_fn fn);
+int       route_compile(void);
+route_fn  route_lookup(int method, const char* target);
+void      route_destroy(void);
+
+#endif
@@ -0,0 +1,66 @@
+#include <stdlib.h>
+#include <fcntl.h>
+
+#include "stream.h"
+#include "fiber.h"
+#include "trace.h"
+
+static off_t threshold = STREAM_THRESHOLD;
+static off_t slice = STREAM_SLICE;
+static uint64_t rate = STREAM_RATE;
+
+//configures streaming, STREAM_THRESHOLD, STREAM_SLICE and STREAM_RATE
+//in the environment override the defaults
+void stream_init(void) {
+    char *env;
+
+    if ((env = getenv("STREAM_THRESHOLD")) != NULL)
+        threshold = (off_t)strtoll(env, NULL, 10);
+    if ((env = getenv("STREAM_SLICE")) != NULL && atoll(env) > 0)
+        slice = (off_t)strtoll(env, NULL, 10);
+    if ((env = getenv("STREAM_RATE")) != NULL)
+        rate = strtoull(env, NULL, 10);
+}
+
+//returns the file size above which responses are streamed
+off_t stream_threshold(void) { return threshold; }
+
+//Sends len bytes of file to client in slices, yielding the worker to other
+//connections between slices and pacing to the configured rate. Pages
+//already sent are dropped from the page cache. Returns 0 if successful,
+//else returns a negative value
+int stream_file(int client, int file, off_t len) {
+    off_t offset = 0, dropped = 0;
+    uint64_t start = trace_now();
+
+    //read ahead aggressively, the file is sent front to back once
+    posix_fadvise(file, 0, len, POSIX_FADV_SEQUENTIAL);
+
+    while (offset < len) {
+        //send one slice, parking whenever the socket is full
+        off_t end = offset + slice < len ? offset + slice : len;
+        while (offset < end)
+            if (fiber_sendfile(client, file, &offset, end - offset) <= 0)
+                return -1;
+
+        //drop pages behind, so big files do not evict small hot ones
+        posix_fadvise(file, dropped, offset - dropped, POSIX_FADV_DONTNEED);
+        dropped = offset;
+
+        //sleep until this connection is back within its share
+        if (rate > 0) {
+            //whole seconds first, scaling offset itself overflows past 18 GB
+            uint64_t sent = (uint64_t)offset;
+            uint64_t due = start + sent / rate * 1000000000ull + sent % rate * 1000000000ull / rate;
+            uint64_t now = trace_now();
+            if (due > now && fiber_sleep(due - now) < 0)
+                return -2;
+        }
+
+        //let other connections on this worker run
+        if (offset < len)
+            fiber_yield();
+    }
+
+    return 0;
+}
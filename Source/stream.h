@@ -0,0 +1,14 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <sys/types.h>
+
+#define STREAM_THRESHOLD  (4 * 1024 * 1024)   //files larger than this are streamed in slices
+#define STREAM_SLICE      (256 * 1024)        //bytes sent before yielding the worker
+#define STREAM_RATE       0                   //bytes per second per connection, 0 for unlimited
+
+void   stream_init(void);
+off_t  stream_threshold(void);
+int    stream_file(int client, int file, off_t len);
+
+#endif
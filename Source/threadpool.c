@@ -1,26 +1,45 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
 #include <pthread.h>
+#include <sys/eventfd.h>
 
 #include "threadpool.h"
+#include "fiber.h"
+#include "trace.h"
 
 //task waiting execution
 typedef struct task_t {
     void (*routine)(void *);
     void *args;
+    uint64_t queued;
     struct task_t *next;
 } task_t;
 
+//tasks of one priority lane, in scheduling order
+typedef struct lane_t {
+    task_t *head;
+    task_t *tail;
+    int pending;
+} lane_t;
+
 //queue of tasks to be scheduled to threads
 typedef struct taskqueue_t {
     pthread_cond_t empty;
     pthread_cond_t notempty;
-    task_t *head;
-    task_t *tail;
+    pthread_cond_t interactive;
+    lane_t lanes[THREADPOOL_LANES];
     int pending;
     int reject;
+    int credit;
 } taskqueue_t;
 
+//shared workers take tasks from every lane, reserved workers only
+//take latency sensitive ones
+#define SHARED        0
+#define RESERVED      1
+
 //the threadpool itself
 struct threadpool_t {
     pthread_mutex_t lock;
@@ -29,58 +48,163 @@ struct threadpool_t {
     int threads_num;
     int threads_running;
     int shutdown;
+    int started;
+    int reserved;
+    int weight;
+    int idle[2];
+    uint64_t polling;
+    int *wakefds;
 };
 
+//enqueue and dequeue timestamps of the task the calling worker is running
+static __thread uint64_t task_queued = 0;
+static __thread uint64_t task_dequeued = 0;
+
+//interrupts a worker waiting on its parked fibers
+static void threadpool_wake(threadpool_t *pool, int id) {
+    uint64_t one = 1;
+    if (write(pool->wakefds[id], &one, sizeof(one)) < 0)
+        perror("threadpool wake");
+}
+
+//returns the bit mask of workers reserved for interactive tasks
+static uint64_t threadpool_reserved(threadpool_t *pool) {
+    return pool->reserved >= 64 ? ~0ull : (1ull << pool->reserved) - 1;
+}
+
+//wakes an idle worker able to take tasks of lane, else one polling its
+//parked fibers. must be called with the pool locked
+static void threadpool_notify(threadpool_t *pool, int lane) {
+    if (lane == LANE_INTERACTIVE && pool->idle[RESERVED] > 0)
+        pthread_cond_signal(&pool->tasks->interactive);
+    else if (pool->idle[SHARED] > 0)
+        pthread_cond_signal(&pool->tasks->notempty);
+    else {
+        uint64_t polling = pool->polling;
+        if (lane != LANE_INTERACTIVE)
+            polling &= ~threadpool_reserved(pool);
+        if (polling)
+            threadpool_wake(pool, __builtin_ctzll(polling));
+    }
+}
+
+//returns the number of tasks a worker may take
+static int threadpool_available(threadpool_t *pool, int kind) {
+    if (kind == RESERVED)
+        return pool->tasks->lanes[LANE_INTERACTIVE].pending;
+    return pool->tasks->pending;
+}
+
+//pops the next task for a worker, interactive tasks go first but a bulk
+//task is taken after every weight interactive ones while both wait.
+//must be called with the pool locked
+static task_t *threadpool_pop(threadpool_t *pool, int kind) {
+    taskqueue_t *tasks = pool->tasks;
+    int lane = LANE_INTERACTIVE;
+
+    if (kind == SHARED && tasks->lanes[LANE_BULK].pending) {
+        if (!tasks->lanes[LANE_INTERACTIVE].pending)
+            lane = LANE_BULK;
+        else if (pool->weight > 0 && tasks->credit >= pool->weight)
+            lane = LANE_BULK;
+    }
+
+    //count interactive tasks taken since the last bulk one
+    if (lane == LANE_INTERACTIVE)
+        tasks->credit++;
+    else
+        tasks->credit = 0;
+
+    //pop current task off of lane, setting lane null if now empty
+    lane_t *cur = &tasks->lanes[lane];
+    task_t *task = cur->head;
+    cur->pending--;
+    tasks->pending--;
+    if (!cur->pending)
+        cur->head = cur->tail = NULL;
+    else
+        cur->head = task->next;
+
+    return task;
+}
+
 //Worker thread of for threadpool threads
+//each task runs on its own fiber, so tasks blocking on sockets park and
+//let the worker pick up further tasks until their sockets are ready
 void *worker(void *p) {
     //get worker's pool
     threadpool_t *pool = (threadpool_t *)p;
 
+    //number workers in start order, lowest ones are reserved
+    pthread_mutex_lock(&pool->lock);
+    int id = pool->started++;
+    pthread_mutex_unlock(&pool->lock);
+
+    //initialize worker's fiber scheduler
+    if (fiber_init(pool->wakefds[id]) < 0) {
+        fprintf(stderr, "Failed to initialize fiber scheduler\n");
+        return NULL;
+    }
+
     //main loop for worker
     while (1) {
         //lock tasks
         pthread_mutex_lock(&pool->lock);
+        int kind = id < pool->reserved ? RESERVED : SHARED;
 
         //wait until task has been scheduled
-        while (!pool->tasks->pending) {
-            //unlock pool and wait for tasks
-            pthread_mutex_unlock(&pool->lock);
-            pthread_cond_wait(&pool->tasks->notempty, &pool->lock);
-
-            //shutting down, terminate thread
-            if (pool->shutdown == 1) {
+        while (!threadpool_available(pool, kind)) {
+            //shutting down, terminate thread once its fibers are done
+            if (pool->shutdown == 1 && !fiber_pending()) {
                 pthread_mutex_unlock(&pool->lock);
+                fiber_destroy();
                 return NULL;
             }
+
+            //resume parked fibers, woken early by newly scheduled tasks
+            if (fiber_pending()) {
+                pool->polling |= 1ull << id;
+                pthread_mutex_unlock(&pool->lock);
+                fiber_poll(-1);
+                pthread_mutex_lock(&pool->lock);
+                pool->polling &= ~(1ull << id);
+                kind = id < pool->reserved ? RESERVED : SHARED;
+                continue;
+            }
+
+            //no fibers to resume, sleep until tasks are scheduled
+            pool->idle[kind]++;
+            pthread_cond_wait(kind == RESERVED ? &pool->tasks->interactive : &pool->tasks->notempty, &pool->lock);
+            pool->idle[kind]--;
+            kind = id < pool->reserved ? RESERVED : SHARED;
         }
 
         //pop current task off of queue to be bandled by worker
-        task_t *cur = pool->tasks->head;
-        pool->tasks->pending--;
-
-        //if pool is now empty, set null
-        //else update head ofg pool
-        if (!pool->tasks->pending)
-            pool->tasks->head = pool->tasks->tail = NULL;
-        else
-            pool->tasks->head = cur->next;
+        task_t *cur = threadpool_pop(pool, kind);
 
         //notify pool that all pending tasks are done
+        //else pass remaining tasks on to other workers
         if (!pool->tasks->pending)
             pthread_cond_signal(&pool->tasks->empty); //wake workers
-
-        //notify pool that not shutting down
-        if (!pool->shutdown)
-            pthread_cond_signal(&pool->tasks->empty); //wake workers
+        for (int lane = 0; lane < THREADPOOL_LANES; lane++)
+            if (pool->tasks->lanes[lane].pending)
+                threadpool_notify(pool, lane);
 
         //unlock pool
         pthread_mutex_unlock(&pool->lock);
 
-        //handle scheduled task
-        (cur->routine)(cur->args);
+        //handle scheduled task on a new fiber
+        task_queued = cur->queued;
+        task_dequeued = trace_now();
+        if (fiber_run(cur->routine, cur->args) < 0)
+            (cur->routine)(cur->args);
 
         //destroy current task
         free(cur);
+
+        //resume fibers that became ready meanwhile without blocking
+        if (fiber_pending())
+            fiber_poll(0);
     }
 
     //to appease the compiler
@@ -113,10 +237,11 @@ threadpool_t *threadpool_create(int num_threads, int num_tasks) {
     }
 
     //initialize empty condition flag
-    //initialize nonempty condition flag
+    //initialize nonempty condition flags
     int notempty = pthread_cond_init(&pool->tasks->notempty, NULL);
+    int interactive = pthread_cond_init(&pool->tasks->interactive, NULL);
     int empty = pthread_cond_init(&pool->tasks->empty, NULL);
-    if (empty != 0 || notempty != 0) {
+    if (empty != 0 || notempty != 0 || interactive != 0) {
         threadpool_destroy(pool);
         return NULL;
     }
@@ -129,11 +254,41 @@ threadpool_t *threadpool_create(int num_threads, int num_tasks) {
     }
 
     //initialize tasks queue
+    for (int lane = 0; lane < THREADPOOL_LANES; lane++) {
+        pool->tasks->lanes[lane].pending = 0;
+        pool->tasks->lanes[lane].head = NULL;
+        pool->tasks->lanes[lane].tail = NULL;
+    }
     pool->tasks->pending = 0;
-    pool->tasks->head = NULL;
-    pool->tasks->tail = NULL;
     pool->tasks->reject = 0;
+    pool->tasks->credit = 0;
     pool->shutdown = 0;
+    pool->threads_running = 0;
+    pool->threads_num = 0;
+    pool->started = 0;
+    pool->reserved = 0;
+    pool->weight = 0;
+    pool->idle[SHARED] = pool->idle[RESERVED] = 0;
+    pool->polling = 0;
+
+    //create wake up events for workers polling parked fibers
+    pool->wakefds = (int *) malloc(sizeof(int) * num_threads);
+    if (pool->wakefds == NULL) {
+        threadpool_destroy(pool);
+        return NULL;
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pool->wakefds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (pool->wakefds[i] < 0) {
+            threadpool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    //block signals in workers so they are delivered to the main thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
 
     //start worker threads
     for (int i = 0; i < num_threads; i++) {
@@ -143,6 +298,7 @@ threadpool_t *threadpool_create(int num_threads, int num_tasks) {
 
         //check if successfully created
         if (created != 0) {
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
             threadpool_destroy(pool);
             return NULL;
         }
@@ -151,16 +307,38 @@ threadpool_t *threadpool_create(int num_threads, int num_tasks) {
         pool->threads_running++;
     }
 
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
     pool->threads_num = pool->threads_running;
 
     return pool;
 }
 
-//schedules task to available worker threads
+//Reserves the first reserved workers for interactive tasks and lets shared
+//workers take a bulk task after every weight interactive ones, 0 gives
+//interactive tasks strict priority. Returns 0 if successful, else -1
+int threadpool_lanes(threadpool_t *pool, int reserved, int weight) {
+    //keep at least one worker for bulk tasks
+    if (pool == NULL || reserved < 0 || reserved >= pool->threads_num || weight < 0)
+        return -1;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->reserved = reserved;
+    pool->weight = weight;
+
+    //let sleeping workers pick up their new role
+    pthread_cond_broadcast(&pool->tasks->notempty);
+    pthread_cond_broadcast(&pool->tasks->interactive);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+//schedules task to available worker threads in the given lane
 //else returns null
-int threadpool_schedule(threadpool_t *pool, task_fn function, void *args) {
+int threadpool_schedule(threadpool_t *pool, task_fn function, void *args, int lane) {
     //sanity check
-    if (pool == NULL)
+    if (pool == NULL || lane < 0 || lane >= THREADPOOL_LANES)
         return -1;
 
     //make sure that tasks queue does not exceed limit
@@ -175,6 +353,7 @@ int threadpool_schedule(threadpool_t *pool, task_fn function, void *args) {
     //initialize new task
     new_task->routine = function;
     new_task->args = args;
+    new_task->queued = trace_now();
     new_task->next = NULL;
 
     //lock task queue
@@ -183,20 +362,24 @@ int threadpool_schedule(threadpool_t *pool, task_fn function, void *args) {
     //if not rejecting, queue task
     //else return error and destroy task
     if (!pool->tasks->reject) {
-        //if tasks not pending, task is only task. Update queue to not empty and announce to threads
-        //if tasks pending, append to end of queue
-        if (!pool->tasks->pending) {
-            pool->tasks->head = pool->tasks->tail = new_task;
-            pthread_cond_signal(&pool->tasks->notempty);
-        }
+        //if lane not pending, task is only task. Update lane to not empty
+        //if tasks pending, append to end of lane
+        lane_t *cur = &pool->tasks->lanes[lane];
+        if (!cur->pending)
+            cur->head = cur->tail = new_task;
         else {
-            pool->tasks->tail->next = new_task;
-            pool->tasks->tail = new_task;
+            cur->tail->next = new_task;
+            cur->tail = new_task;
         }
 
         //incremenent pending tasks
+        cur->pending++;
         pool->tasks->pending++;
 
+        //lane was empty, wake a worker to start draining it
+        if (cur->pending == 1)
+            threadpool_notify(pool, lane);
+
         //unlock queue
         pthread_mutex_unlock(&pool->lock);
 
@@ -208,6 +391,13 @@ int threadpool_schedule(threadpool_t *pool, task_fn function, void *args) {
     }
 }
 
+//returns when the task running on the calling worker was scheduled and
+//when it was picked up, both as trace_now() timestamps
+void threadpool_task_times(uint64_t *queued, uint64_t *dequeued) {
+    *queued = task_queued;
+    *dequeued = task_dequeued;
+}
+
 //destroys the tasks queue, including threads, flags, and mutex locks
 //else returns error
 int threadpool_destroy_tasks(threadpool_t *pool) {
@@ -223,6 +413,10 @@ int threadpool_destroy_tasks(threadpool_t *pool) {
     pthread_mutex_destroy(&pool->lock);
     pthread_cond_destroy(&pool->tasks->empty);
     pthread_cond_destroy(&pool->tasks->notempty);
+    pthread_cond_destroy(&pool->tasks->interactive);
+    for (int i = 0; pool->wakefds != NULL && i < pool->threads_num; i++)
+        close(pool->wakefds[i]);
+    free(pool->wakefds);
 
     //destroy tasks queue
     free(pool->tasks);
@@ -244,6 +438,10 @@ int threadpool_destroy(threadpool_t *pool) {
     //set shutdown flag, broadcast queue notempty
     pool->shutdown = 1;
     pthread_cond_broadcast(&pool->tasks->notempty); //wake workers
+    pthread_cond_broadcast(&pool->tasks->interactive);
+    for (int i = 0; i < pool->threads_num; i++)
+        if (pool->polling & (1ull << i))
+            threadpool_wake(pool, i);
 
     //unlock pool
     pthread_mutex_unlock(&pool->lock);
@@ -254,6 +452,7 @@ int threadpool_destroy(threadpool_t *pool) {
         printf("---worker %i killed\n", i);
         pthread_join(pool->threads[i], NULL);           //kill worker when done task
         pthread_cond_broadcast(&pool->tasks->notempty); //stop threads from sleeping
+        pthread_cond_broadcast(&pool->tasks->interactive);
         pool->threads_running--;
     }
 
@@ -1,14 +1,22 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
+#include <stdint.h>
+
 #define MAX_THREADS   64
 #define MAX_TASKS     65536
 
+#define LANE_INTERACTIVE  0     //latency sensitive tasks, served first
+#define LANE_BULK         1     //long running transfers
+#define THREADPOOL_LANES  2
+
 typedef struct threadpool_t threadpool_t;
 typedef void (*task_fn)(void *);
 
 threadpool_t* threadpool_create(int num_threads, int num_tasks);
-int           threadpool_schedule(threadpool_t* pool, task_fn, void *arg);
+int           threadpool_lanes(threadpool_t* pool, int reserved, int weight);
+int           threadpool_schedule(threadpool_t* pool, task_fn, void *arg, int lane);
 int           threadpool_destroy(threadpool_t* pool);
+void          threadpool_task_times(uint64_t* queued, uint64_t* dequeued);
 
 #endif
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "trace.h"
+
+//recorded span, guarded by a per slot sequence number so that
+//readers can detect slots overwritten while being copied
+typedef struct span_t {
+    atomic_uint_fast64_t seq;
+    uint32_t id;
+    uint32_t phase;
+    uint64_t start;
+    uint64_t end;
+} span_t;
+
+//single producer ring buffer owned by one thread
+typedef struct ring_t {
+    atomic_uint_fast64_t head;
+    int tid;
+    span_t spans[TRACE_EVENTS];
+} ring_t;
+
+static const char *phases[] = {
+    "accept", "queue", "parse", "open", "header", "sendfile", "cache", "request"};
+
+static _Atomic(ring_t *) rings[TRACE_THREADS];
+static atomic_int rings_num = 0;
+static atomic_uint_fast32_t requests = 0;
+static uint32_t sample = TRACE_SAMPLE;
+static uint64_t epoch = 0;
+
+static __thread ring_t *local = NULL;
+
+//configures sampling, TRACE_SAMPLE in the environment overrides the default
+void trace_init(void) {
+    char *env = getenv("TRACE_SAMPLE");
+    if (env != NULL)
+        sample = (uint32_t)strtoul(env, NULL, 10);
+
+    epoch = trace_now();
+}
+
+//returns a request id if the next request should be traced,
+//else returns 0
+uint32_t trace_sample(void) {
+    if (sample == 0)
+        return 0;
+
+    uint32_t id = (uint32_t)atomic_fetch_add(&requests, 1) + 1;
+    if (id % sample != 0)
+        return 0;
+
+    return id;
+}
+
+//returns the calling thread's ring buffer, registering one on first use
+static ring_t *trace_ring(void) {
+    if (local != NULL)
+        return local;
+
+    int slot = atomic_fetch_add(&rings_num, 1);
+    if (slot >= TRACE_THREADS)
+        return NULL;
+
+    ring_t *ring = (ring_t *)calloc(1, sizeof(ring_t));
+    if (ring == NULL)
+        return NULL;
+
+    ring->tid = slot;
+    atomic_store(&rings[slot], ring);
+    local = ring;
+
+    return ring;
+}
+
+//records a span of a traced request, does nothing for untraced ones
+void trace_span(uint32_t id, trace_phase phase, uint64_t start, uint64_t end) {
+    if (id == 0)
+        return;
+
+    ring_t *ring = trace_ring();
+    if (ring == NULL)
+        return;
+
+    //mark slot as being written, fill it, then publish it
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    span_t *span = &ring->spans[head % TRACE_EVENTS];
+
+    atomic_store_explicit(&span->seq, 2 * head + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    span->id = id;
+    span->phase = phase;
+    span->start = start;
+    span->end = end;
+    atomic_store_explicit(&span->seq, 2 * head + 2, memory_order_release);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+//writes all spans still held in the ring buffers as Chrome trace JSON,
+//returns 0 if successful, else returns a negative value
+int trace_dump(trace_sink sink, void *ctx) {
+    char buf[256];
+    int sep = 0;
+
+    if (sink(ctx, "{\"traceEvents\":[", 16) < 0)
+        return -1;
+
+    int num = atomic_load(&rings_num);
+    if (num > TRACE_THREADS)
+        num = TRACE_THREADS;
+
+    for (int i = 0; i < num; i++) {
+        ring_t *ring = atomic_load(&rings[i]);
+        if (ring == NULL)
+            continue;
+
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t tail = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+
+        for (uint64_t cur = tail; cur < head; cur++) {
+            span_t *span = &ring->spans[cur % TRACE_EVENTS];
+
+            //copy span, skipping it if the writer lapped us meanwhile
+            uint64_t seq = atomic_load_explicit(&span->seq, memory_order_acquire);
+            if (seq != 2 * cur + 2)
+                continue;
+
+            span_t copy;
+            copy.id = span->id;
+            copy.phase = span->phase;
+            copy.start = span->start;
+            copy.end = span->end;
+
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&span->seq, memory_order_relaxed) != seq)
+                continue;
+
+            //timestamps are in microseconds since trace_init
+            uint64_t start = copy.start > epoch ? copy.start - epoch : 0;
+            uint64_t dur = copy.end > copy.start ? copy.end - copy.start : 0;
+            int len = snprintf(buf, sizeof(buf),
+                "%s\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%.3f,"
+                "\"dur\":%.3f,\"pid\":1,\"tid\":%i,\"args\":{\"request\":%u}}",
+                sep ? "," : "", phases[copy.phase], start / 1000.0, dur / 1000.0,
+                ring->tid, copy.id);
+
+            if (sink(ctx, buf, len) < 0)
+                return -1;
+            sep = 1;
+        }
+    }
+
+    if (sink(ctx, "\n]}\n", 4) < 0)
+        return -1;
+
+    return 0;
+}
+
+//writes chunk of a dump to a file
+static int trace_fsink(void *ctx, const char *buf, size_t len) {
+    return fwrite(buf, 1, len, (FILE *)ctx) == len ? 0 : -1;
+}
+
+//dumps all spans to a file at path,
+//returns 0 if successful, else returns a negative value
+int trace_dump_file(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL)
+        return -1;
+
+    int res = trace_dump(trace_fsink, out);
+    if (fclose(out) != 0)
+        return -2;
+
+    return res;
+}
@@ -0,0 +1,44 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "threadpool.h"
+
+#define TRACE_SAMPLE    0               //trace 1 in every N requests, 0 disables tracing
+#define TRACE_EVENTS    4096            //spans kept in each thread's ring buffer
+#define TRACE_THREADS   (MAX_THREADS + 1)
+#define TRACE_DUMP      "/trace.json"   //written on SIGUSR1, relative to webroot
+#define TRACE_ENDPOINT  "/_trace"       //admin endpoint serving the same dump
+
+//phases of a request that are recorded as spans
+typedef enum {
+    TRACE_ACCEPT,
+    TRACE_QUEUE,
+    TRACE_PARSE,
+    TRACE_OPEN,
+    TRACE_HEADER,
+    TRACE_SENDFILE,
+    TRACE_CACHE,
+    TRACE_REQUEST
+} trace_phase;
+
+//receives chunks of the dump, returns negative to abort the dump
+typedef int (*trace_sink)(void *ctx, const char *buf, size_t len);
+
+void      trace_init(void);
+uint32_t  trace_sample(void);
+void      trace_span(uint32_t id, trace_phase phase, uint64_t start, uint64_t end);
+int       trace_dump(trace_sink sink, void *ctx);
+int       trace_dump_file(const char *path);
+
+//returns a monotonic timestamp in nanoseconds
+static inline uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+#endif
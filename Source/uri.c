@@ -0,0 +1,113 @@
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "uri.h"
+
+//returns the value of a hex digit, else returns -1
+static int uri_hex(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+//ends the segment starting at seg, dropping it if it is "."
+//returns 0 if successful, else returns URI_TRAVERSAL for ".."
+static int uri_segment(char* out, size_t* len, size_t seg) {
+  size_t size = *len - seg;
+  if (size == 1 && out[seg] == '.')
+    *len = seg;
+  else if (size == 2 && out[seg] == '.' && out[seg + 1] == '.')
+    return URI_TRAVERSAL;
+  return 0;
+}
+
+//Decodes and canonicalizes the request target into out: the query and
+//fragment are stripped, escapes decoded, empty and "." segments removed
+//and URI_INDEX appended to directories, so equivalent targets give the
+//same path. Returns the length of the path if successful, else returns
+//one of the negative URI_ errors
+int uri_canonicalize(const char* target, char* out, size_t size) {
+  size_t len, in = 1, pos = 1, seg = 1;
+
+  if (target == NULL || target[0] != '/' || size < 2)
+    return URI_INVALID;
+  len = strlen(target);
+  out[0] = '/';
+
+  while (in < len) {
+#if defined(__SSE2__)
+    //copy runs without escapes, separators, query or fragment 16 bytes at a time
+    const __m128i percent = _mm_set1_epi8('%'), slash = _mm_set1_epi8('/');
+    const __m128i query = _mm_set1_epi8('?'), hash = _mm_set1_epi8('#');
+    while (in + 16 <= len) {
+      __m128i block = _mm_loadu_si128((const __m128i*)(target + in));
+      int mask = _mm_movemask_epi8(_mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(block, percent), _mm_cmpeq_epi8(block, slash)),
+        _mm_or_si128(_mm_cmpeq_epi8(block, query), _mm_cmpeq_epi8(block, hash))));
+      size_t run = mask ? (size_t)__builtin_ctz(mask) : 16;
+
+      if (pos + run >= size)
+        return URI_TOO_LONG;
+      memcpy(out + pos, target + in, run);
+      pos += run;
+      in += run;
+      if (mask)
+        break;
+    }
+    if (in >= len)
+      break;
+#endif
+
+    char c = target[in];
+    if (c == '?' || c == '#')
+      break;
+
+    //decode escape, decoded bytes are treated as if sent literally
+    if (c == '%') {
+      int high = uri_hex(target[in + 1]);
+      int low = high >= 0 ? uri_hex(target[in + 2]) : -1;
+      if (low < 0)
+        return URI_INVALID;
+      c = (char)(high << 4 | low);
+      if (c == 0)
+        return URI_NUL;
+      in += 3;
+    }
+    else
+      in++;
+
+    //end segment, collapsing repeated separators
+    if (c == '/') {
+      if (uri_segment(out, &pos, seg) < 0)
+        return URI_TRAVERSAL;
+      if (out[pos - 1] != '/') {
+        if (pos + 1 >= size)
+          return URI_TOO_LONG;
+        out[pos++] = '/';
+      }
+      seg = pos;
+      continue;
+    }
+
+    if (pos + 1 >= size)
+      return URI_TOO_LONG;
+    out[pos++] = c;
+  }
+
+  if (uri_segment(out, &pos, seg) < 0)
+    return URI_TRAVERSAL;
+
+  //directory, serve its index
+  if (out[pos - 1] == '/') {
+    if (pos + sizeof(URI_INDEX) > size)
+      return URI_TOO_LONG;
+    memcpy(out + pos, URI_INDEX, sizeof(URI_INDEX));
+    return pos + sizeof(URI_INDEX) - 1;
+  }
+
+  out[pos] = 0;
+  return pos;
+}
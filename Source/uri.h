@@ -0,0 +1,15 @@
+#ifndef URI_H
+#define URI_H
+
+#include <stddef.h>
+
+#define URI_INDEX       "index.html"    //appended to targets naming a directory
+
+#define URI_INVALID     -1              //not an origin form target or bad escape
+#define URI_TOO_LONG    -2              //canonical path does not fit
+#define URI_TRAVERSAL   -3              //contains a ".." segment
+#define URI_NUL         -4              //contains an escaped NUL
+
+int uri_canonicalize(const char* target, char* out, size_t size);
+
+#endif